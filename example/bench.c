@@ -0,0 +1,228 @@
+/***************************************************************************************
+ *
+ * Banc de mesure de la librairie Robopoly
+ * Fichier: bench.c
+ *
+ * Mesure en cycles le temps d'exécution des fonctions publiques et de toutes les interruptions,
+ * modules optionnels compris (extint.c, param.c, twi.c).
+ * Le timer 1 compte à fclk pendant chaque mesure; les interruptions sont appelées
+ * directement (sans les 4 cycles d'entrée dans le vecteur).
+ * Les résultats sont envoyés sur l'UART à la fin, une ligne par mesure:
+ *     cycles<TAB>nom<TAB>nombre
+ *
+ * "make bench" compile ce programme pour l'ATmega16 (même brochage et mêmes périphériques
+ * que l'ATmega8535, qui n'existe pas dans simavr) et l'exécute sous simavr avec benchsim.c.
+ * Il tourne aussi tel quel sur le robot, les résultats sortent alors sur le port série.
+ *
+ ***************************************************************************************/
+
+#include <stdlib.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
+#include "robopoly.h"
+#include "lcam.h"
+#include "extint.h"
+#include "param.h"
+#include "twi.h"
+
+// Interruptions de robopoly.c et des modules optionnels, appelées comme des fonctions
+void ADC_vect(void);
+void USART_RX_vect(void);
+void USART_UDRE_vect(void);
+void TIMER0_OVF_vect(void);
+void TIMER0_COMP_vect(void);
+void TIMER1_OVF_vect(void);
+void TIMER2_OVF_vect(void);
+void TIMER2_COMP_vect(void);
+void INT0_vect(void);
+void INT1_vect(void);
+void INT2_vect(void);
+void EE_RDY_vect(void);
+void TWI_vect(void);
+
+#define BENCH_MAX	56
+
+static PGM_P benchNames[BENCH_MAX];
+static unsigned int benchCycles[BENCH_MAX];
+static unsigned char benchCount = 0;
+static unsigned int benchZero;		// coût de la mesure elle-même
+
+static void benchStore(PGM_P name, unsigned int cycles)
+{
+	if(benchCount < BENCH_MAX)
+	{
+		benchNames[benchCount] = name;
+		benchCycles[benchCount] = cycles - benchZero;
+		benchCount++;
+	}
+}
+
+// Mesure de code, interruptions désactivées (elles sont réactivées par le reti des vecteurs)
+#define BENCH(name, code)	do{							\
+		unsigned int benchStart;						\
+		unsigned char benchSreg = SREG;					\
+		cli();											\
+		benchStart = TCNT1;								\
+		code;											\
+		benchStart = TCNT1 - benchStart;				\
+		SREG = benchSreg;								\
+		benchStore(PSTR(name), benchStart);				\
+	}while(0)
+
+// Mesure de code qui attend des interruptions
+#define BENCH_IRQ(name, code)	do{						\
+		unsigned int benchStart;						\
+		sei();											\
+		benchStart = TCNT1;								\
+		code;											\
+		benchStart = TCNT1 - benchStart;				\
+		benchStore(PSTR(name), benchStart);				\
+	}while(0)
+
+static void benchNothing(void)
+{
+}
+
+// Attend TWINT, interruptions désactivées (borné si le TWI n'est pas simulé)
+static unsigned char benchTwiWait(void)
+{
+	unsigned int n;
+
+	for(n = 0; n < 20000 && !(TWCR & (1<<TWINT)); n++)
+	{
+	}
+	return (TWCR >> TWINT) & 1;
+}
+
+static void benchReport(void)
+{
+	char number[6];
+	unsigned char i;
+
+	uartSendByte('\n');		// sépare les octets envoyés par les mesures de l'UART
+	for(i = 0; i < benchCount; i++)
+	{
+		uartSendString_P(PSTR("cycles\t"));
+		uartSendString_P(benchNames[i]);
+		uartSendByte('\t');
+		uartSendString(utoa(benchCycles[i], number, 10));
+		uartSendByte('\n');
+	}
+	uartSendString_P(PSTR("end\n"));
+	while(UCSRB & (1<<UDRIE));	// le buffer d'envoi est vide
+	waitms(2);
+}
+
+int main(void)
+{
+	static unsigned char image[LCAM_PIXELS];
+	lcam_stats_t stats;
+	volatile unsigned char port = 'B', bit = 2, value = 1;
+	unsigned int start;
+	unsigned char i;
+	extintEvent event;
+	twiTransfer transfer;
+	static unsigned char twiData[2];
+
+	TCCR1A = 0;
+	TCCR1B = 1;				// timer 1 à fclk: un pas par cycle
+	start = TCNT1;
+	benchZero = TCNT1 - start;
+
+	uartInit();
+	timerStart();
+
+	// GPIO
+	BENCH("digitalWrite_const", digitalWrite(B, 2, 1));
+	BENCH("digitalWrite_var", digitalWriteRuntime(port, bit, value));
+	BENCH("digitalRead_const", value = digitalRead(B, 2));
+	BENCH("digitalRead_var", value = digitalReadRuntime(port, bit));
+
+	// ADC
+	BENCH_IRQ("analogReadPortA_first", value = analogReadPortA(0));
+	BENCH_IRQ("analogReadPortA", value = analogReadPortA(0));
+	BENCH("analogGet", analogGet(0));
+	BENCH("isr_ADC", ADC_vect());
+
+	// UART (rebouclée sous simavr)
+	BENCH("uartSendByte", uartSendByte('x'));
+	BENCH("uartSendString", uartSendString("bench"));
+	BENCH("uartSendString_P", uartSendString_P(PSTR("bench")));
+	sei();
+	waitms(10);
+	BENCH("uartGetByte", value = uartGetByte());
+	BENCH("isr_USART_RX", USART_RX_vect());
+	BENCH("isr_USART_UDRE", USART_UDRE_vect());
+
+	// timer 0: alarme et agenda
+	timerAlarm(100, benchNothing);
+	BENCH("isr_TIMER0_COMP", TIMER0_COMP_vect());
+	BENCH("addNewCallback", addNewCallback(benchNothing, 10, 0));
+	BENCH("isr_TIMER0_OVF", TIMER0_OVF_vect());
+	BENCH("agendaDispatch", agendaDispatch());
+
+	// servos
+	set_servo(0, 50);
+	BENCH("set_servo", set_servo(1, 30));
+	BENCH("isr_TIMER2_OVF", TIMER2_OVF_vect());
+	BENCH("isr_TIMER2_COMP", TIMER2_COMP_vect());
+
+	// moteurs: consignes nulles, le timer 1 reste en mode normal pour la mesure.
+	// Sur MOTOR_PERIOD débordements, un seul fait le calcul du PI.
+	BENCH("isr_TIMER1_OVF", TIMER1_OVF_vect());
+	BENCH("isr_TIMER1_OVF_period", for(i = 0; i < MOTOR_PERIOD; i++) TIMER1_OVF_vect());
+
+	// interruptions externes (vecteurs appelés sans flanc, anti-rebond nul)
+	BENCH("isr_INT0", INT0_vect());
+	BENCH("isr_INT1", INT1_vect());
+	BENCH("isr_INT2", INT2_vect());
+	BENCH("extintGet", extintGet(&event));
+	while(extintGet(&event));
+
+	// attentes
+	BENCH("waitus_50", waitus(50));
+	BENCH("waitms_1", waitms(1));
+
+	// caméra (TSL3301 simulée par benchsim sur le port C)
+	lcam_initport();
+	BENCH("lcam_reset", lcam_reset());
+	BENCH("lcam_setup", lcam_setup());
+	BENCH("lcam_startintegration", lcam_startintegration());
+	BENCH("lcam_stop", lcam_stop(image));
+	lcam_startintegration();
+	BENCH("lcam_stop_stats", lcam_stop_stats(image, &stats));
+	lcam_startintegration();
+	BENCH("lcam_stop_roi_30", lcam_stop_roi(image, 36, 30));
+	BENCH("lcam_analyse", lcam_analyse(image, &stats));
+	lcam_ae_init(50, 20000);
+	BENCH("lcam_ae_update", lcam_ae_update(image));
+	BENCH("lcam_getpic", value = lcam_getpic(image));
+
+	// TWI: transaction vers une adresse sans esclave, chaque pas est fait à la main
+	twiInit(100000);
+	cli();
+	BENCH("twiWriteRead", twiWriteRead(&transfer, 0x50, twiData, 1, twiData, 2, 0));
+	if(benchTwiWait())
+	{
+		BENCH("isr_TWI_start", TWI_vect());		// START envoyé: écrit SLA+W
+	}
+	cli();
+	if(benchTwiWait())
+	{
+		BENCH("isr_TWI_finish", TWI_vect());	// SLA+W sans ACK: fin de la transaction et STOP
+	}
+
+	// paramètres: un byte d'EEPROM par interruption, puis écriture en arrière-plan jusqu'au bout
+	BENCH("paramInit", paramInit());
+	param.motorKp++;
+	BENCH("paramSave", paramSave());
+	BENCH("isr_EE_RDY", EE_RDY_vect());
+	sei();
+	while(paramBusy());
+
+	benchReport();
+
+	cli();
+	sleep_mode();			// simavr s'arrête: sommeil interruptions désactivées
+	return 0;
+}
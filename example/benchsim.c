@@ -0,0 +1,265 @@
+/***************************************************************************************
+ *
+ * Banc de mesure de la librairie Robopoly (côté PC)
+ * Fichier: benchsim.c
+ *
+ * Exécute bench.elf sous simavr (ATmega16 à 8MHz) sans interface graphique et recopie
+ * sur la sortie standard les lignes "cycles" envoyées par le programme sur l'UART.
+ * Périphériques simulés:
+ *  - une TSL3301 sur le port C (lignes de lcam_config.h): décodage des commandes sur SDIN
+ *    et envoi d'une image de 102 pixels sur SDOUT après chaque commande READPixel;
+ *  - l'UART est rebouclée (chaque octet envoyé revient en réception).
+ *
+ * Compilation: gcc benchsim.c -o benchsim -lsimavr -lelf (voir "make bench")
+ *
+ ***************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sim_avr.h>
+#include <sim_elf.h>
+#include <avr_ioport.h>
+#include <avr_uart.h>
+#include "lcam_config.h"
+
+#define BENCH_FREQUENCY	8000000
+#define BENCH_MAX_CYCLES	400000000ULL	// 50s simulées: le programme est planté
+
+#define CAM_PIXELS			102
+#define CAM_READY_DELAY		3			// impulsions entre READPixel et le premier bit de start
+
+static avr_t *avr;
+static avr_irq_t *camSdout;
+static avr_irq_t *uartIn;
+
+// Réception des commandes de la caméra
+static int camSdin = 1;
+static int camSclk = 0;
+static int camZeros = 0;
+static int camRxBits = -1;		// -1: attente d'un bit de start
+static unsigned char camRxByte;
+static int camRegWrite = 0;		// le prochain octet est la valeur d'un registre
+
+// Envoi des pixels
+static int camTxPos = -1;		// bit en cours d'envoi, -1: rien à envoyer
+static int camTxDelay;
+static unsigned char camFrame[CAM_PIXELS];
+static int camFrames = 0;
+
+// Ligne reçue de l'UART
+static char uartLine[128];
+static int uartLength = 0;
+static int benchDone = 0;
+
+static void camDrive(int level)
+{
+	avr_raise_irq(camSdout, level ? 1 : 0);
+}
+
+// Trame de 10 bits par pixel: start (0), 8 bits LSB en premier, stop (1)
+static int camBit(int pos)
+{
+	int pixel = pos / 10, k = pos % 10;
+
+	if(pixel >= CAM_PIXELS || k == 9)
+	{
+		return 1;
+	}
+	if(k == 0)
+	{
+		return 0;
+	}
+	return (camFrame[pixel] >> (k - 1)) & 1;
+}
+
+// Fond sombre et une ligne claire qui se déplace d'une image à l'autre
+static void camNewFrame(void)
+{
+	int i, d, center = 20 + (camFrames * 7) % 60;
+
+	for(i = 0; i < CAM_PIXELS; i++)
+	{
+		d = abs(i - center);
+		camFrame[i] = 20 + (i & 3) + ((d < 4) ? 180 - 45*d : 0);
+	}
+	camFrames++;
+}
+
+static void camCommand(unsigned char cmd)
+{
+	if(camRegWrite)
+	{
+		camRegWrite = 0;
+		return;
+	}
+	if((cmd & 0xE0) == 0x40)		// REGWrite
+	{
+		camRegWrite = 1;
+		return;
+	}
+	if(cmd == 0x02)					// READPixel
+	{
+		camNewFrame();
+		camTxPos = 0;
+		camTxDelay = CAM_READY_DELAY;
+	}
+	// RESET (0x1B), STARTInt (0x08), SAMPLEInt (0x10): rien à simuler
+}
+
+// SDIN est lu sur le flanc montant de SCLK
+static void camClockRise(void)
+{
+	camZeros = camSdin ? 0 : camZeros + 1;
+	if(camZeros > 10)
+	{
+		// plus de 10 zéros: resynchronisation de l'interface (lcam_reset)
+		camRxBits = -1;
+		camRegWrite = 0;
+		camTxPos = -1;
+		camDrive(1);
+		return;
+	}
+
+	if(camRxBits < 0)
+	{
+		if(!camSdin)
+		{
+			camRxBits = 0;
+			camRxByte = 0;
+		}
+	}
+	else if(camRxBits < 8)
+	{
+		camRxByte |= camSdin << camRxBits;
+		camRxBits++;
+	}
+	else
+	{
+		camRxBits = -1;
+		if(camSdin)
+		{
+			camCommand(camRxByte);
+		}
+	}
+}
+
+// SDOUT passe au bit suivant sur le flanc descendant de SCLK
+static void camClockFall(void)
+{
+	if(camTxPos < 0)
+	{
+		return;
+	}
+	if(camTxDelay > 0)
+	{
+		camTxDelay--;
+		camDrive(camTxDelay ? 1 : camBit(0));
+		return;
+	}
+	camTxPos++;
+	if(camTxPos >= CAM_PIXELS * 10)
+	{
+		camTxPos = -1;
+		camDrive(1);
+		return;
+	}
+	camDrive(camBit(camTxPos));
+}
+
+static void camSclkHook(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+	if(value && !camSclk)
+	{
+		camClockRise();
+	}
+	else if(!value && camSclk)
+	{
+		camClockFall();
+	}
+	camSclk = value ? 1 : 0;
+}
+
+static void camSdinHook(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+	camSdin = value ? 1 : 0;
+}
+
+static void uartOutHook(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+	avr_raise_irq(uartIn, value);		// rebouclage
+
+	if(value == '\n')
+	{
+		uartLine[uartLength] = 0;
+		if(strncmp(uartLine, "cycles\t", 7) == 0)
+		{
+			printf("%s\n", uartLine);
+		}
+		else if(strcmp(uartLine, "end") == 0)
+		{
+			benchDone = 1;
+		}
+		uartLength = 0;
+	}
+	else if(uartLength < (int)sizeof(uartLine) - 1)
+	{
+		uartLine[uartLength++] = value;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	elf_firmware_t firmware;
+	uint32_t flags = 0;
+	int state;
+
+	if(argc != 2)
+	{
+		fprintf(stderr, "usage: %s bench.elf\n", argv[0]);
+		return 2;
+	}
+
+	memset(&firmware, 0, sizeof(firmware));
+	if(elf_read_firmware(argv[1], &firmware) != 0)
+	{
+		fprintf(stderr, "%s: lecture impossible\n", argv[1]);
+		return 2;
+	}
+	firmware.frequency = BENCH_FREQUENCY;
+
+	avr = avr_make_mcu_by_name("atmega16");
+	if(!avr)
+	{
+		fprintf(stderr, "simavr ne connaît pas l'atmega16\n");
+		return 2;
+	}
+	avr_init(avr);
+	avr_load_firmware(avr, &firmware);
+	avr->frequency = BENCH_FREQUENCY;
+
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('C'), LCAM_SCLK), camSclkHook, NULL);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('C'), LCAM_SDIN), camSdinHook, NULL);
+	camSdout = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('C'), LCAM_SDOUT);
+	camDrive(1);
+
+	avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS('0'), &flags);
+	flags &= ~AVR_UART_FLAG_STDIO;
+	avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS('0'), &flags);
+	uartIn = avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_INPUT);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUTPUT), uartOutHook, NULL);
+
+	do
+	{
+		state = avr_run(avr);
+	}
+	while(state != cpu_Done && state != cpu_Crashed && avr->cycle < BENCH_MAX_CYCLES);
+
+	if(!benchDone)
+	{
+		fprintf(stderr, "bench: le programme n'a pas terminé (état %d, %llu cycles)\n",
+			state, (unsigned long long)avr->cycle);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,193 @@
+/***************************************************************************************
+ *
+ * Interruptions externes INT0, INT1 et INT2 avec file d'événements
+ * Fichier: extint.c
+ *
+ * File circulaire sans verrou: extintHead n'est écrit que par les interruptions, après
+ * l'événement; extintTail n'est écrit que par la boucle principale, après la copie.
+ * Les index tournent sur 8 bits, EXTINT_QUEUE est une puissance de 2.
+ *
+ ***************************************************************************************/
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "robopoly.h"
+#include "extint.h"
+
+// Empêche le compilateur de déplacer les accès à la file autour de la publication d'un index
+#define EXTINT_BARRIER()	__asm__ __volatile__("" ::: "memory")
+
+static extintEvent extintQueue[EXTINT_QUEUE];
+static volatile unsigned char extintHead = 0;
+static volatile unsigned char extintTail = 0;
+
+static extintHandler extintHandlers[EXTINT_COUNT];
+static unsigned int extintDebounce[EXTINT_COUNT];
+static unsigned long extintLast[EXTINT_COUNT];	// dernier événement accepté
+
+volatile unsigned char extintDropped = 0;
+
+// Bit de la ligne dans GICR et GIFR
+static unsigned char extintBit(unsigned char line)
+{
+	switch(line)
+	{
+		case EXTINT_INT0:
+			return 1<<INT0;
+		case EXTINT_INT1:
+			return 1<<INT1;
+		default:
+			return 1<<INT2;
+	}
+}
+
+static void extintPin(volatile unsigned char *port, unsigned char bit, unsigned char pullup)
+{
+	*(port - 1) &= ~(1<<bit);		// DDR
+	if(pullup)
+	{
+		*port |= (1<<bit);
+	}
+	else
+	{
+		*port &= ~(1<<bit);
+	}
+}
+
+void extintAttach(unsigned char line, unsigned char edge, unsigned int debounce_us, extintHandler handler)
+{
+	unsigned char sreg = SREG;
+	unsigned char mode = edge & 0x03;
+	unsigned char pullup = edge & EXTINT_PULLUP;
+
+	if(line >= EXTINT_COUNT || mode == 0 || (line == EXTINT_INT2 && mode == EXTINT_CHANGE))
+	{
+		return;
+	}
+
+	timerStart();
+
+	cli();
+	GICR &= ~extintBit(line);		// le flanc ne doit pas changer interruption active
+	extintHandlers[line] = handler;
+	extintDebounce[line] = debounce_us;
+	extintLast[line] = micros() - debounce_us;
+
+	switch(line)
+	{
+		case EXTINT_INT0:
+			extintPin(&PORTD, PD2, pullup);
+			MCUCR = (MCUCR & ~((1<<ISC01)|(1<<ISC00))) | (mode << ISC00);
+			break;
+		case EXTINT_INT1:
+			extintPin(&PORTD, PD3, pullup);
+			MCUCR = (MCUCR & ~((1<<ISC11)|(1<<ISC10))) | (mode << ISC10);
+			break;
+		default:
+			extintPin(&PORTB, PB2, pullup);
+			if(mode == EXTINT_RISING)
+			{
+				MCUCSR |= (1<<ISC2);
+			}
+			else
+			{
+				MCUCSR &= ~(1<<ISC2);
+			}
+			break;
+	}
+
+	GIFR = extintBit(line);		// flanc éventuellement détecté pendant la configuration
+	GICR |= extintBit(line);
+	SREG = sreg;
+}
+
+void extintDetach(unsigned char line)
+{
+	unsigned char sreg = SREG;
+
+	if(line >= EXTINT_COUNT)
+	{
+		return;
+	}
+	cli();
+	GICR &= ~extintBit(line);
+	SREG = sreg;
+}
+
+unsigned char extintGet(extintEvent *event)
+{
+	unsigned char tail = extintTail;
+
+	if(tail == extintHead)
+	{
+		return 0;
+	}
+	EXTINT_BARRIER();
+	*event = extintQueue[tail & (EXTINT_QUEUE - 1)];
+	EXTINT_BARRIER();
+	extintTail = tail + 1;		// la place est rendue après la copie
+	return 1;
+}
+
+void extintDispatch(void)
+{
+	extintEvent event;
+
+	while(extintGet(&event))
+	{
+		if(extintHandlers[event.line])
+		{
+			extintHandlers[event.line](&event);
+		}
+	}
+}
+
+// Appelée interruptions désactivées
+static inline void extintCapture(unsigned char line, unsigned char level)
+{
+	unsigned long now = micros();
+	unsigned char head = extintHead;
+	extintEvent *e;
+
+	if(now - extintLast[line] < extintDebounce[line])
+	{
+		return;		// rebond
+	}
+	extintLast[line] = now;
+
+	if((unsigned char)(head - extintTail) >= EXTINT_QUEUE)
+	{
+		extintDropped++;
+		return;
+	}
+	e = &extintQueue[head & (EXTINT_QUEUE - 1)];
+	e->time = now;
+	e->line = line;
+	e->level = level;
+	EXTINT_BARRIER();
+	extintHead = head + 1;		// publié
+}
+
+ISR(INT0_vect)
+{
+	ISR_STATS_BEGIN(0)
+	ISR_WAKE()
+	extintCapture(EXTINT_INT0, (PIND >> PD2) & 1);
+	ISR_STATS_END(ISR_STATS_INT0, GIFR & (1<<INTF0))
+}
+
+ISR(INT1_vect)
+{
+	ISR_STATS_BEGIN(0)
+	ISR_WAKE()
+	extintCapture(EXTINT_INT1, (PIND >> PD3) & 1);
+	ISR_STATS_END(ISR_STATS_INT1, GIFR & (1<<INTF1))
+}
+
+ISR(INT2_vect)
+{
+	ISR_STATS_BEGIN(0)
+	ISR_WAKE()
+	extintCapture(EXTINT_INT2, (PINB >> PB2) & 1);
+	ISR_STATS_END(ISR_STATS_INT2, GIFR & (1<<INTF2))
+}
@@ -0,0 +1,113 @@
+#ifndef __extint_h
+#define __extint_h
+/***************************************************************************************
+ *
+ * Interruptions externes INT0, INT1 et INT2 avec file d'événements
+ * Fichier: extint.h
+ *
+ ***************************************************************************************/
+
+/** \defgroup extint_h Interruptions externes
+
+	\brief	Capture des flancs sur INT0 (PD2), INT1 (PD3) et INT2 (PB2), datés et mis en file
+
+	Chaque flanc est capturé par son interruption, même pendant un waitms ou une lecture de la caméra,
+	daté avec micros() (résolution 8us) et mis dans une file lue par la boucle principale avec
+	extintGet(), ou par extintDispatch() qui appelle les fonctions données à extintAttach().
+
+	L'anti-rebond ignore les flancs qui suivent un événement accepté de moins de debounce_us.
+	La file n'a qu'un producteur (les interruptions, qui ne s'imbriquent pas) et un consommateur
+	(la boucle principale): elle est lue sans désactiver les interruptions.
+
+	\code
+	static void bumper(const extintEvent *e)
+	{
+		motorSpeed(0, 0);
+	}
+
+	int main(void)
+	{
+		extintAttach(EXTINT_INT0, EXTINT_FALLING | EXTINT_PULLUP, 5000, bumper);	// contact à la masse
+		sei();
+		while(1)
+		{
+			extintDispatch();
+			//...
+		}
+	}
+	\endcode
+
+	Les vecteurs INT0_vect, INT1_vect et INT2_vect sont définis par ce module: ne pas l'ajouter au projet
+	si le programme a ses propres routines pour ces interruptions.
+
+	PB2 (INT2) est aussi la ligne par défaut de SERVO_7 (robopoly.h): set_servo(7, ...) la passerait en sortie
+	et l'interruption verrait les impulsions du servo. Avec INT2, déplacer ce servo (servoAttach(7, ...) ou
+	SERVO_7_PORT/SERVO_7_BIT) ou ne pas l'utiliser.
+
+*/
+/*@{*/
+
+#ifdef notimer
+#error "les événements sont datés avec le timer 0"
+#endif
+
+#ifndef EXTINT_QUEUE
+#define EXTINT_QUEUE	8		// Evénements en attente, puissance de 2 (6 bytes de RAM chacun)
+#endif
+
+#if EXTINT_QUEUE & (EXTINT_QUEUE - 1)
+#error "EXTINT_QUEUE doit être une puissance de 2"
+#endif
+
+/** \brief Lignes d'interruption */
+enum {EXTINT_INT0, EXTINT_INT1, EXTINT_INT2, EXTINT_COUNT};
+
+/** \brief Flancs (EXTINT_CHANGE: INT0 et INT1 seulement) */
+enum {EXTINT_CHANGE = 1, EXTINT_FALLING = 2, EXTINT_RISING = 3};
+
+#define EXTINT_PULLUP	0x80		// A ajouter au flanc: active la résistance de tirage de la pin
+
+/** \brief Un flanc capturé */
+typedef struct
+{
+	unsigned long time;			// micros() au moment de l'interruption
+	unsigned char line;			// EXTINT_INT0, EXTINT_INT1 ou EXTINT_INT2
+	unsigned char level;		// Niveau de la pin lu dans l'interruption (0 ou 1)
+} extintEvent;
+
+typedef void (*extintHandler)(const extintEvent *event);
+
+/** \brief Active une interruption externe
+
+	Démarre le timer 0 si nécessaire. Les interruptions globales doivent être activées (sei()).
+
+	\param line EXTINT_INT0, EXTINT_INT1 ou EXTINT_INT2
+	\param edge EXTINT_CHANGE, EXTINT_FALLING ou EXTINT_RISING, éventuellement | EXTINT_PULLUP
+	\param debounce_us Temps mort après chaque événement accepté (0: aucun)
+	\param handler Fonction appelée par extintDispatch() (0: événements lus avec extintGet())
+
+*/
+void extintAttach(unsigned char line, unsigned char edge, unsigned int debounce_us, extintHandler handler);
+
+/** \brief Désactive une interruption externe (les événements déjà en file restent) */
+void extintDetach(unsigned char line);
+
+/** \brief Retire l'événement le plus ancien de la file
+
+	\return 1 si event a été rempli, 0 si la file est vide
+
+*/
+unsigned char extintGet(extintEvent *event);
+
+/** \brief Vide la file en appelant la fonction de chaque ligne (à appeler depuis la boucle principale)
+
+	Les événements des lignes sans fonction sont retirés sans rien faire.
+
+*/
+void extintDispatch(void);
+
+/** \brief Evénements perdus parce que la file était pleine */
+extern volatile unsigned char extintDropped;
+
+/*@}*/
+#endif
@@ -0,0 +1,143 @@
+#!/usr/bin/env python
+"""Fake MegaLoad 5 bootloaders on pseudo-terminals, to try pygaload without
+any board connected.
+
+Each fake board gets its own pty, whose name is printed on standard output.
+A board behaves like a PRisme that has just been reset: it sends 0x55 until
+a client answers, reports an ATmega8535, receives FLASH pages, and starts
+over once the 0xFFFF end marker is received (like a reset). The pages
+written are kept in memory and counted on standard error.
+
+    ./fakeloader.py -n 3 &
+    ./pygaload.py -p /dev/pts/5 -p /dev/pts/6 -p /dev/pts/7 --stats example.hex
+
+Faults can be injected to exercise pygaload's retries: --bad-checksum makes
+a fraction of the pages fail with '@', and --dead makes the last boards
+never answer at all.
+"""
+
+import sys
+import os
+import pty
+import tty
+import errno
+import fcntl
+import select
+import random
+import threading
+import time
+from optparse import OptionParser
+
+# ATmega8535, 8k flash, 256-word boot section, 64-byte pages, 512-byte EEPROM
+DEVICE_INFO = 'I' + 'l' + 'b' + 'R' + '1'
+PAGE_SIZE   = 64
+
+_usage = """%prog [Options]"""
+
+class Board:
+  def __init__(self, options, number):
+    self.options = options
+    self.number = number
+    self.master, slave = pty.openpty()
+    tty.setraw(slave)
+    fcntl.fcntl(self.master, fcntl.F_SETFL, fcntl.fcntl(self.master, fcntl.F_GETFL) | os.O_NONBLOCK)
+    self.name = os.ttyname(slave)
+    self.slave = slave    # Kept open so the pty survives between clients
+    self.flash = {}
+    self.sessions = 0
+
+  def log(self, text):
+    sys.stderr.write('%s: %s\n' % (self.name, text))
+
+  def send(self, s):
+    # Nobody may be reading the pty: drop what does not fit
+    try:
+      os.write(self.master, s)
+    except OSError, detail:
+      if detail.errno != errno.EAGAIN:
+        raise
+
+  def read(self, n, timeout=None):
+    s = ''
+    while len(s) < n:
+      r, w, x = select.select([self.master], [], [], timeout)
+      if not r:
+        return None
+      s += os.read(self.master, n - len(s))
+    return s
+
+  def handshake(self):
+    # Autobaud: 0x55 until 0x55 comes back, then '>' and wait for '<'
+    while 1:
+      self.send('\x55')
+      c = self.read(1, 0.05)
+      if c == '\x55':
+        break
+    self.send('>')
+    while self.read(1) != '<':
+      pass
+    self.send(DEVICE_INFO + '!')
+
+  def session(self):
+    written = 0
+    while 1:
+      header = self.read(2)
+      pagenum = ord(header[0])*256 + ord(header[1])
+      if pagenum == 0xFFFF:
+        return written
+
+      data = self.read(PAGE_SIZE)
+      checksum = ord(self.read(1))
+      time.sleep(self.options.WriteTime)
+
+      if sum(map(ord, data)) & 0xFF != checksum or random.random() < self.options.BadChecksum:
+        self.send('@')
+        continue
+
+      self.flash[pagenum] = data
+      written += 1
+      self.send('!')
+
+  def run(self):
+    while 1:
+      self.handshake()
+      written = self.session()
+      self.sessions += 1
+      self.log('session %d: %d pages written, %d pages in flash' % (self.sessions, written, len(self.flash)))
+
+  def dead(self):
+    # Never answers, drains whatever is sent
+    while 1:
+      self.read(1)
+
+if __name__ == "__main__":
+  parser = OptionParser(usage=_usage)
+  parser.add_option("-n", "--boards", dest="Boards", type="int", default=1, metavar="N", \
+                    help="Number of fake boards (default: 1)")
+  parser.add_option("-w", "--write-time", dest="WriteTime", type="float", default=0.005, metavar="SEC", \
+                    help="Time to write one page (default: 0.005)")
+  parser.add_option("--bad-checksum", dest="BadChecksum", type="float", default=0.0, metavar="P", \
+                    help="Probability of answering '@' to a correct page (default: 0)")
+  parser.add_option("--dead", dest="Dead", type="int", default=0, metavar="N", \
+                    help="Number of boards that never answer (default: 0)")
+  (options, args) = parser.parse_args()
+
+  boards = [Board(options, i) for i in range(options.Boards)]
+  for board in boards:
+    print board.name
+  sys.stdout.flush()
+
+  for board in boards:
+    if board.number >= options.Boards - options.Dead:
+      target = board.dead
+    else:
+      target = board.run
+    thread = threading.Thread(target=target)
+    thread.setDaemon(True)
+    thread.start()
+
+  try:
+    while 1:
+      time.sleep(1)
+  except KeyboardInterrupt:
+    pass
@@ -72,6 +72,53 @@ void lcam_stop(unsigned char *image);
 void lcam_endintegration(void);	//Fin de l'intégration
 unsigned char lcam_readout(void);		//Préparation à la lecture
 void lcam_read(unsigned char *image); //Lecture et sauvegarde dans buffer
+unsigned char lcam_readpixel(void);	//Lecture d'un seul pixel
+void lcam_readn(unsigned char *image, unsigned char count);	//Lecture des count pixels suivants
+void lcam_skippixels(unsigned char count);	//Passe les count pixels suivants sans les lire
+void lcam_resync(void);		//Remet l'interface série au repos, arrête l'envoi des pixels
+
+
+/** \brief Fin de l'intégration et lecture d'une fenêtre de pixels
+
+	Pour suivre une ligne dont on connaît la position approximative: seuls les pixels start à start+length-1
+	sont lus et écrits, à leur place dans image; les autres pixels de image ne sont pas modifiés.
+	Les pixels avant la fenêtre sont passés sans être lus (~5us chacun au lieu de ~14us avec le backend logiciel)
+	et l'envoi est interrompu après la fenêtre (resynchronisation de l'interface, sans toucher aux registres):
+	la caméra est prête plus tôt pour l'intégration suivante.
+
+	\param image Zone mémoire de LCAM_PIXELS bytes
+	\param start Premier pixel de la fenêtre (0 à 101)
+	\param length Nombre de pixels, réduit si la fenêtre dépasse la fin de l'image
+	\return 0 si la fenêtre a été lue, 1 si la caméra a planté (elle est alors remise à zéro comme pour lcam_stop())
+
+*/
+unsigned char lcam_stop_roi(unsigned char *image, unsigned char start, unsigned char length);
+
+
+/** \brief Fin de l'intégration et lecture de deux caméras à la fois
+
+	Seulement avec LCAM_SDOUT2 défini dans lcam_config.h (backend logiciel): les deux caméras partagent SDIN et SCLK,
+	leurs pixels sont lus sur les mêmes impulsions, en ~25% de temps en plus qu'une seule image.
+	Toutes les fonctions lcam_* de commande (reset, setup, intégration, registres) s'adressent aux deux caméras.
+	Si elles ne sont pas prêtes ensemble, elles sont remises à zéro comme pour lcam_stop() et les buffers ne sont pas modifiés.
+
+	\param image Image de la caméra sur LCAM_SDOUT (102 pixels)
+	\param image2 Image de la caméra sur LCAM_SDOUT2 (102 pixels)
+
+*/
+void lcam_stop2(unsigned char *image, unsigned char *image2);
+
+unsigned char lcam_readout2(void);		//Préparation à la lecture des deux caméras
+void lcam_read2(unsigned char *image, unsigned char *image2);	//Lecture des deux caméras
+
+
+/** \brief Ecriture d'un registre de la caméra
+
+	\param reg Commande d'écriture: 0x40/0x42/0x44 offset gauche/milieu/droite, 0x41/0x43/0x45 gain, 0x5F mode
+	\param value Valeur (gain 0 à 31, offset 8 bits signe-magnitude)
+
+*/
+void lcam_writereg(unsigned char reg, unsigned char value);
 
 
 /** \brief Fonction pour la recherche d'un pic
@@ -88,6 +135,154 @@ void lcam_read(unsigned char *image); //Lecture et sauvegarde dans buffer
 
 */
 unsigned char lcam_getpic(unsigned char *image);
+
+
+/** \brief Nombre de pixels d'une image */
+#define LCAM_PIXELS	102
+
+
+#ifndef LCAM_ZONE_SIZE
+#define LCAM_ZONE_SIZE		4	// Pixels par zone (les zones commencent au pixel 1, comme lcam_getpic)
+#endif
+#define LCAM_ZONES			((LCAM_PIXELS - 2) / LCAM_ZONE_SIZE)
+#ifndef LCAM_PEAKS
+#define LCAM_PEAKS			4	// Nombre maximum de pics rapportés
+#endif
+#ifndef LCAM_MIN_CONTRAST
+#define LCAM_MIN_CONTRAST	11	// Contraste max-min en dessous duquel aucun pic n'est rapporté
+#endif
+#ifndef LCAM_PEAK_WIDTH
+#define LCAM_PEAK_WIDTH		4	// Demi-largeur maximale d'un pic pour le calcul du centre
+#endif
+
+/** \brief Statistiques d'une image
+
+	Les positions sont données en 1/256 de pixel: (position >> 8) est le numéro du pixel (0 à 101).
+
+*/
+typedef struct
+{
+	unsigned char min;					// Pixel le plus sombre
+	unsigned char max;					// Pixel le plus lumineux
+	unsigned char maxpos;				// Numéro du pixel le plus lumineux
+	unsigned char confidence;			// Hauteur du pic principal au-dessus du second (ou du minimum), 0 si pas de pic
+	unsigned int position;				// Centre du pic principal en 1/256 de pixel
+	unsigned char peaks;				// Nombre de pics trouvés (peut dépasser LCAM_PEAKS)
+	unsigned int peak[LCAM_PEAKS];		// Centre des pics, de gauche à droite
+	unsigned int zones[LCAM_ZONES];		// Somme des pixels de chaque zone
+} lcam_stats_t;
+
+/** \brief Fin de l'intégration, lecture et analyse en une seule passe
+
+	Comme lcam_stop(), mais les statistiques sont calculées pendant la réception des pixels.
+	L'image n'est pas modifiée. Le centre d'un pic est le barycentre des pixels contigus au-dessus de la mi-hauteur
+	(min + (max - min)/2) autour de son maximum. Si la caméra a planté, confidence et peaks valent 0.
+
+	\param image Zone mémoire de LCAM_PIXELS bytes pour l'image brute
+	\param stats Résultats
+
+*/
+void lcam_stop_stats(unsigned char *image, lcam_stats_t *stats);
+
+/** \brief Même analyse que lcam_stop_stats() sur une image déjà en mémoire (acquisition asynchrone) */
+void lcam_analyse(const unsigned char *image, lcam_stats_t *stats);
+
+
+/** \brief Réglages de l'auto-exposition */
+typedef struct
+{
+	unsigned int exposure_us;	// Temps d'intégration en microsecondes
+	unsigned char gain[3];		// Gain des segments gauche/milieu/droite (0 à 31)
+	signed char offset[3];		// Offset des segments gauche/milieu/droite (-127 à 127)
+} lcam_ae_t;
+
+#ifndef LCAM_AE_TARGET
+#define LCAM_AE_TARGET		192	// Valeur visée pour le pixel le plus lumineux
+#endif
+#ifndef LCAM_AE_MARGIN
+#define LCAM_AE_MARGIN		32	// Pas de correction tant que le pic est à moins de LCAM_AE_MARGIN de la cible
+#endif
+#ifndef LCAM_AE_BLACK
+#define LCAM_AE_BLACK		8	// Niveau visé pour le pixel le plus sombre de chaque segment
+#endif
+#ifndef LCAM_AE_OFFSET_MAX
+#define LCAM_AE_OFFSET_MAX	32	// Correction d'offset maximale
+#endif
+
+/** \brief Démarrage de l'auto-exposition
+
+	Après chaque image, le temps d'intégration et le gain sont corrigés pour amener le pixel le plus lumineux vers
+	LCAM_AE_TARGET, au plus d'un facteur 2 par image. Quand l'image est trop sombre, le temps d'intégration est
+	allongé jusqu'à max_us avant d'augmenter le gain; quand elle est trop claire, le gain est d'abord ramené à 0.
+	L'offset de chaque segment (34 pixels) ramène son pixel le plus sombre vers LCAM_AE_BLACK.
+
+	Pendant l'acquisition asynchrone, la correction est faite automatiquement entre deux images.
+	Sinon, il faut appeler lcam_ae_update() après chaque lcam_stop().
+
+	\param min_us Temps d'intégration minimum en microsecondes
+	\param max_us Temps d'intégration maximum, à choisir selon la cadence d'images voulue
+
+*/
+void lcam_ae_init(unsigned int min_us, unsigned int max_us);
+
+/** \brief Correction après une image (acquisition synchrone seulement)
+
+	Calcule les nouveaux réglages et écrit les registres de la caméra.
+
+	\param image Image qui vient d'être lue
+	\return Temps d'intégration à utiliser pour la prochaine image en microsecondes
+
+*/
+unsigned int lcam_ae_update(const unsigned char *image);
+
+/** \brief Bloque (1) ou relâche (0) les réglages actuels de l'auto-exposition */
+void lcam_ae_lock(unsigned char lock);
+
+/** \brief Copie les réglages actuels de l'auto-exposition */
+void lcam_ae_get(lcam_ae_t *settings);
+
+
+/** \brief Démarrage de l'acquisition asynchrone
+
+	Les images sont prises en continu sous interruption (alarme du timer 0, voir timerAlarm dans robopoly.h):
+	la caméra intègre pendant exposure_us sans occuper le processeur, puis l'image est lue dans l'un des deux buffers.
+	Le buffer rendu par lcam_acquire_frame() n'est jamais écrit tant qu'une autre image n'a pas été prise.
+	La récupération après un plantage de la caméra (reset) est la même que pour lcam_stop().
+
+	Les fonctions lcam_* synchrones ne doivent pas être utilisées tant que l'acquisition asynchrone tourne.
+
+	\param buffers Zone mémoire de 2 x LCAM_PIXELS bytes
+	\param exposure_us Temps d'intégration en microsecondes (résolution 8us)
+	\param period_ms Temps entre deux débuts d'intégration en millisecondes (max 524ms, ~100ms conseillé), lecture non comprise
+
+*/
+void lcam_async_start(unsigned char *buffers, unsigned int exposure_us, unsigned int period_ms);
+
+/** \brief Modification du temps d'intégration et de la période, pris en compte à l'image suivante
+
+	Si l'auto-exposition est active, exposure_us est remplacé par le temps calculé à chaque image.
+
+*/
+void lcam_async_timing(unsigned int exposure_us, unsigned int period_ms);
+
+/** \brief Arrêt de l'acquisition asynchrone */
+void lcam_async_stop(void);
+
+/** \brief Retourne 1 si une nouvelle image complète est disponible */
+unsigned char lcam_frame_ready(void);
+
+/** \brief Retourne la dernière image complète
+
+	L'image retournée reste valable jusqu'au prochain appel de lcam_acquire_frame(). Si aucune nouvelle image n'est
+	arrivée, la même image est retournée à nouveau.
+
+	\return Pointeur vers LCAM_PIXELS pixels, ou 0 si aucune image n'a encore été prise
+
+*/
+unsigned char *lcam_acquire_frame(void);
+
+/** \brief Nombre de plantages de la caméra rattrapés par un reset pendant l'acquisition asynchrone */
+unsigned char lcam_async_errors(void);
 /*@}*/
 
 #endif
@@ -147,6 +342,38 @@ unsigned char lcam_getpic(unsigned char *image);
 
 
 
+	\endcode
+
+	\section lcamasync Exemple d'acquisition asynchrone
+
+	\code
+
+	#include "robopoly.h"
+	#include "lcam.h"
+
+	unsigned char buffers[2*LCAM_PIXELS];	//Deux images: la caméra remplit l'une pendant qu'on traite l'autre
+
+	int main(){
+		unsigned char *image;
+		unsigned char valeur;
+
+		lcam_initport();
+		lcam_reset();
+		lcam_setup();
+		waitms(2);
+
+		lcam_ae_init(50, 20000);				//Auto-exposition entre 50us et 20ms (facultatif)
+		lcam_async_start(buffers, 400, 100);	//400us d'exposition, une image toutes les 100ms
+
+		while(1){
+			if(lcam_frame_ready()){
+				image = lcam_acquire_frame();
+				valeur = lcam_getpic(image);	//Traitement de l'image
+			}
+			//Le reste du programme tourne pendant l'exposition
+		}
+	}
+
 	\endcode
 
 	*/
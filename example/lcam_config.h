@@ -0,0 +1,61 @@
+#ifndef __lcam_config_h
+#define __lcam_config_h
+//**************************************************************//
+//* Configuration des lignes de la caméra linéaire TSL3301      //
+//* Inclus par lcam.S et par les fichiers C de la librairie     //
+//**************************************************************//
+
+// Le backend est choisi à la compilation: avec LCAM_USE_SPI (make LCAM_BACKEND=spi) les commandes et
+// les pixels passent par le SPI matériel (lcam_spi.c), sinon les lignes sont pilotées par logiciel (lcam.S).
+// Les lignes du backend logiciel peuvent aussi être données à la compilation (ex: -DLCAM_SDOUT=2).
+
+#ifdef LCAM_USE_SPI
+
+// Lignes imposées par le SPI de l'ATmega8535
+#define LCAM_PORT_REG	PORTB
+#define LCAM_DDR_REG	DDRB
+#define LCAM_PIN_REG	PINB
+
+#define LCAM_SDIN		5		// MOSI
+#define LCAM_SDOUT		6		// MISO
+#define LCAM_SCLK		7		// SCK
+#define LCAM_SS			4		// doit rester en sortie pour que le SPI reste maître
+
+// PB4 est aussi la ligne par défaut de SERVO_9 (robopoly.h). Le servo peut la garder, car une sortie ne
+// change pas le mode du SPI. Mais rien ne doit la repasser en entrée (DDRB, _DDRB4...): tirée à 0,
+// elle ferait passer le SPI en esclave et la lecture de la caméra ne finirait pas.
+// Pour libérer PB4, déplacer le servo avec servoAttach(9, ...) ou SERVO_9_PORT/SERVO_9_BIT.
+
+#ifdef LCAM_SDOUT2
+#error "deux caméras seulement avec le backend logiciel (lcam.S)"
+#endif
+
+#else
+
+#ifndef LCAM_PORT_REG
+#define LCAM_PORT_REG	PORTC	// Port sur lequel la cam est branchée
+#define LCAM_DDR_REG	DDRC	// DDR du port sur lequel la cam est branchée
+#define LCAM_PIN_REG	PINC	// PIN du port sur lequel la cam est branchée
+#endif
+
+#ifndef LCAM_SDIN
+#define LCAM_SDIN		3		// Pin du port sur lequel le SDIN de la cam est branché
+#endif
+#ifndef LCAM_SDOUT
+#define LCAM_SDOUT		4		// Pin du port sur lequel le SDOUT de la cam est branché
+#endif
+#ifndef LCAM_SCLK
+#define LCAM_SCLK		5		// Pin du port sur lequel le SDCLK de la cam est branché
+#endif
+
+// Deuxième caméra (lcam_stop2): SDIN et SCLK partagés avec la première, SDOUT sur une autre pin
+// du même port pour que les deux pixels soient lus par le même "in"
+//#define LCAM_SDOUT2	2
+
+#if defined(LCAM_SDOUT2) && (LCAM_SDOUT2 == LCAM_SDOUT || LCAM_SDOUT2 == LCAM_SDIN || LCAM_SDOUT2 == LCAM_SCLK)
+#error "LCAM_SDOUT2 doit être une pin libre du port de la caméra"
+#endif
+
+#endif
+
+#endif
@@ -0,0 +1,256 @@
+//**************************************************************//
+//* Backend SPI de la librairie pour la caméra TSL3301          //
+//* Remplace les fonctions de communication de lcam.S quand     //
+//* LCAM_USE_SPI est défini (make LCAM_BACKEND=spi)             //
+//**************************************************************//
+
+// Le SPI envoie et reçoit par octets alors que la TSL3301 travaille par trames de 10 bits
+// (start à 0, 8 bits LSB en premier, stop à 1):
+// - une commande est envoyée sur deux octets, complétés par des 1 que la caméra ignore (SDIN au repos);
+// - les pixels arrivent en continu, ils sont réalignés dans un accumulateur de bits à partir
+//   du bit de start trouvé par lcam_readout.
+
+#include <avr/io.h>
+#include "lcam.h"
+#include "lcam_config.h"
+
+#ifdef LCAM_USE_SPI
+
+static unsigned int lcam_acc;		// bits reçus pas encore décodés, le plus ancien en bit 0
+static unsigned char lcam_nbits;
+static unsigned char lcam_skip;	// le bit de stop du dernier pixel arrive avec l'octet suivant
+
+static unsigned char lcam_spi(unsigned char out)
+{
+	SPDR = out;
+	while(!(SPSR & (1<<SPIF)));
+	return SPDR;
+}
+
+// Envoie une commande, retourne les bits lus sur SDOUT pendant le deuxième octet
+static unsigned char lsend(unsigned char cmd)
+{
+	lcam_spi(cmd << 1);						// start, bits 0 à 6
+	return lcam_spi((cmd >> 7) | 0xFE);		// bit 7, stop, repos
+}
+
+// 8 x bytes impulsions sur SCLK avec SDIN à 1
+static void lcam_clocks(unsigned char bytes)
+{
+	for(; bytes; bytes--)
+	{
+		lcam_spi(0xFF);
+	}
+}
+
+void lcam_initport(void)
+{
+	LCAM_DDR_REG |= (1<<LCAM_SDIN)|(1<<LCAM_SCLK)|(1<<LCAM_SS);
+	LCAM_DDR_REG &= ~(1<<LCAM_SDOUT);
+	LCAM_PORT_REG &= ~(1<<LCAM_SCLK);
+
+	SPCR = (1<<SPE)|(1<<DORD)|(1<<MSTR);	// maître, LSB en premier, mode 0 (SDIN lu sur le flanc montant)
+	SPSR = (1<<SPI2X);						// fclk/2 = 4MHz
+}
+
+void lcam_writereg(unsigned char reg, unsigned char value)
+{
+	lsend(reg);
+	lsend(value);
+}
+
+void lcam_setup(void)
+{
+	unsigned char reg;
+
+	for(reg = 0x40; reg <= 0x45; reg += 2)
+	{
+		lcam_writereg(reg, 0);			// offset
+		lcam_writereg(reg + 1, 15);		// gain
+	}
+}
+
+void lcam_resync(void)
+{
+	lcam_spi(0x00);			// 32 impulsions avec SDIN à 0
+	lcam_spi(0x00);
+	lcam_spi(0x00);
+	lcam_spi(0x00);
+	lcam_clocks(2);			// 16 impulsions avec SDIN à 1
+}
+
+void lcam_reset(void)
+{
+	lcam_resync();
+
+	lsend(0x1B);			// Commande de Reset
+	lcam_clocks(1);
+
+	lsend(0x5F);			// Ecriture du mode register
+	lsend(0x00);			// Clear mode register(single chip, not sleep)
+}
+
+void lcam_startintegration(void)
+{
+	lsend(0x08);			// Commande STARTInt
+	lcam_clocks(3);			// 22 impulsions au moins
+}
+
+void lcam_endintegration(void)
+{
+	lsend(0x10);			// Commande SAMPLEInt
+	lcam_clocks(1);
+}
+
+// Attend le bit de start du premier pixel, retourne 0xFF si la caméra ne répond pas
+unsigned char lcam_readout(void)
+{
+	unsigned char in, bit, tries;
+
+	in = lsend(0x02) | 0x03;		// Commande READPixel, les bits 0 et 1 sont ceux de la commande
+
+	for(tries = 32; ; tries--)
+	{
+		if(in != 0xFF)
+		{
+			// le premier 0 est le bit de start
+			for(bit = 0; in & 1; bit++)
+			{
+				in >>= 1;
+			}
+			lcam_acc = in;
+			lcam_nbits = 8 - bit;
+			lcam_skip = 0;
+			return 0;
+		}
+		if(tries == 0)
+		{
+			return 0xFF;		// timeout si la caméra plante
+		}
+		in = lcam_spi(0xFF);
+	}
+}
+
+// Pixel par pixel, sans recouvrement des transferts
+unsigned char lcam_readpixel(void)
+{
+	unsigned char in, pixel;
+
+	while(lcam_nbits < 9)
+	{
+		in = lcam_spi(0xFF);
+		if(lcam_skip)
+		{
+			lcam_acc |= (unsigned int)(in >> 1) << lcam_nbits;
+			lcam_nbits += 7;
+			lcam_skip = 0;
+		}
+		else
+		{
+			lcam_acc |= (unsigned int)in << lcam_nbits;
+			lcam_nbits += 8;
+		}
+	}
+
+	pixel = lcam_acc >> 1;
+	if(lcam_nbits >= 10)
+	{
+		lcam_acc >>= 10;
+		lcam_nbits -= 10;
+	}
+	else
+	{
+		lcam_acc = 0;
+		lcam_nbits = 0;
+		lcam_skip = 1;
+	}
+	return pixel;
+}
+
+void lcam_readn(unsigned char *image, unsigned char count)
+{
+	for(; count; count--)
+	{
+		*image++ = lcam_readpixel();
+	}
+}
+
+void lcam_skippixels(unsigned char count)
+{
+	for(; count; count--)
+	{
+		lcam_readpixel();
+	}
+}
+
+void lcam_read(unsigned char *image)
+{
+	unsigned char *end = image + LCAM_PIXELS;
+	unsigned int acc = lcam_acc;
+	unsigned char nbits = lcam_nbits;
+	unsigned char skip = lcam_skip;		// après lcam_readpixel ou lcam_skippixels
+	unsigned char in;
+
+	// un pixel au plus est complété par octet reçu
+	if(nbits >= 9)
+	{
+		*image++ = acc >> 1;
+		if(nbits >= 10)
+		{
+			acc >>= 10;
+			nbits -= 10;
+		}
+		else
+		{
+			acc = 0;
+			nbits = 0;
+			skip = 1;
+		}
+	}
+
+	SPDR = 0xFF;
+	while(image != end)
+	{
+		while(!(SPSR & (1<<SPIF)));
+		in = SPDR;
+		SPDR = 0xFF;			// l'octet suivant est transféré pendant le décodage
+
+		if(skip)
+		{
+			in >>= 1;			// bit de stop du pixel précédent
+			acc |= (unsigned int)in << nbits;
+			nbits += 7;
+			skip = 0;
+		}
+		else
+		{
+			acc |= (unsigned int)in << nbits;
+			nbits += 8;
+		}
+
+		if(nbits >= 9)
+		{
+			*image++ = acc >> 1;
+			if(nbits >= 10)
+			{
+				acc >>= 10;
+				nbits -= 10;
+			}
+			else
+			{
+				acc = 0;		// le bit de stop arrive avec l'octet suivant
+				nbits = 0;
+				skip = 1;
+			}
+		}
+	}
+	while(!(SPSR & (1<<SPIF)));
+
+	// les bits restants et l'octet reçu d'avance ne sont pas décodés: un lcam_readpixel qui suivrait
+	// ne doit pas les reprendre
+	lcam_acc = 0;
+	lcam_nbits = 0;
+	lcam_skip = 0;
+}
+
+#endif
@@ -9,24 +9,604 @@
 //23-05-2009: Modification de lcam_stop pour gérer l'erreur de timeout (Christophe Winter)
 
 #include "lcam.h"
+#include "lcam_config.h"
 #include <avr/io.h>
 #include "robopoly.h"
 
-void lcam_stop(unsigned char *image){
+//-----Auto-exposition
+enum {LCAM_AE_OFF, LCAM_AE_ON, LCAM_AE_LOCKED};
+
+static lcam_ae_t lcam_ae = {400, {15, 15, 15}, {0, 0, 0}};	// valeurs de lcam_setup
+static unsigned int lcam_ae_min;
+static unsigned int lcam_ae_max;
+static volatile unsigned char lcam_ae_mode = LCAM_AE_OFF;
+static volatile unsigned char lcam_ae_dirty = 0;	// registres à réécrire
+
+static void lcam_ae_write(void)
+{
+	unsigned char seg;
+	signed char offset;
+
+	for(seg = 0; seg < 3; seg++)
+	{
+		offset = lcam_ae.offset[seg];
+		// offset en signe-magnitude
+		lcam_writereg(0x40 + 2*seg, (offset < 0) ? 0x80 | (unsigned char)(-offset) : (unsigned char)offset);
+		lcam_writereg(0x41 + 2*seg, lcam_ae.gain[seg]);
+	}
+	lcam_ae_dirty = 0;
+}
+
+// Calcule les réglages pour l'image suivante, retourne 1 si les registres ont changé
+static unsigned char lcam_ae_control(const unsigned char *image)
+{
+	unsigned char seg, i, pixel, low, lows[3], peak = 0, changed = 0;
+	unsigned char gain = lcam_ae.gain[0];
+	unsigned int exposure = lcam_ae.exposure_us;
+	unsigned char ratio;		// correction voulue en 1/16, de 8 (x0.5) à 32 (x2)
+	int offset, delta;
+
+	for(seg = 0; seg < 3; seg++)
+	{
+		low = 255;
+		for(i = 0; i < LCAM_PIXELS/3; i++)
+		{
+			pixel = *image++;
+			if(pixel > peak)
+			{
+				peak = pixel;
+			}
+			if(pixel < low)
+			{
+				low = pixel;
+			}
+		}
+		lows[seg] = low;
+	}
+
+	// niveau du noir, segment par segment (sans signification si l'image est saturée)
+	for(seg = 0; seg < 3 && peak < 255; seg++)
+	{
+		delta = (int)LCAM_AE_BLACK - lows[seg];
+		if(delta > LCAM_AE_BLACK/2 || delta < -(LCAM_AE_BLACK/2))
+		{
+			offset = lcam_ae.offset[seg] + delta/2;
+			if(offset > LCAM_AE_OFFSET_MAX)
+			{
+				offset = LCAM_AE_OFFSET_MAX;
+			}
+			if(offset < -LCAM_AE_OFFSET_MAX)
+			{
+				offset = -LCAM_AE_OFFSET_MAX;
+			}
+			if(offset != lcam_ae.offset[seg])
+			{
+				lcam_ae.offset[seg] = offset;
+				changed = 1;
+			}
+		}
+	}
+
+	// amplitude du signal: le pic
+	if(peak >= 255)
+	{
+		ratio = 8;		// saturé, on ne sait pas de combien
+	}
+	else if(peak > LCAM_AE_TARGET + LCAM_AE_MARGIN || peak < LCAM_AE_TARGET - LCAM_AE_MARGIN)
+	{
+		peak = (peak > LCAM_AE_BLACK) ? peak - LCAM_AE_BLACK : 1;
+		delta = (16*(LCAM_AE_TARGET - LCAM_AE_BLACK)) / peak;
+		ratio = (delta > 32) ? 32 : (delta < 8) ? 8 : delta;
+	}
+	else
+	{
+		return changed;
+	}
+
+	if(ratio > 16)
+	{
+		// trop sombre: temps d'intégration puis gain
+		if(exposure < lcam_ae_max)
+		{
+			exposure = ((unsigned long)exposure * ratio) / 16 + 1;
+			lcam_ae.exposure_us = (exposure > lcam_ae_max) ? lcam_ae_max : exposure;
+		}
+		else if(gain < 31)
+		{
+			gain += ratio - 16;
+			gain = (gain > 31) ? 31 : gain;
+		}
+	}
+	else if(ratio < 16)
+	{
+		// trop clair: gain puis temps d'intégration
+		if(gain > 0)
+		{
+			gain = (gain > 16 - ratio) ? gain - (16 - ratio) : 0;
+		}
+		else if(exposure > lcam_ae_min)
+		{
+			exposure = ((unsigned long)exposure * ratio) / 16;
+			lcam_ae.exposure_us = (exposure < lcam_ae_min) ? lcam_ae_min : exposure;
+		}
+	}
+
+	if(gain != lcam_ae.gain[0])
+	{
+		lcam_ae.gain[0] = lcam_ae.gain[1] = lcam_ae.gain[2] = gain;
+		changed = 1;
+	}
+	return changed;
+}
+
+// Correction après une image, la caméra doit être inactive
+static void lcam_ae_frame(const unsigned char *image)
+{
+	if(lcam_ae_mode == LCAM_AE_ON && lcam_ae_control(image))
+	{
+		lcam_ae_dirty = 1;
+	}
+	if(lcam_ae_dirty)
+	{
+		lcam_ae_write();
+	}
+}
+
+void lcam_ae_init(unsigned int min_us, unsigned int max_us)
+{
+	unsigned char sreg = SREG;
+	unsigned char seg;
+
+	cli();
+	lcam_ae_min = min_us;
+	lcam_ae_max = (max_us > min_us) ? max_us : min_us;
+	if(lcam_ae.exposure_us < lcam_ae_min)
+	{
+		lcam_ae.exposure_us = lcam_ae_min;
+	}
+	if(lcam_ae.exposure_us > lcam_ae_max)
+	{
+		lcam_ae.exposure_us = lcam_ae_max;
+	}
+	for(seg = 0; seg < 3; seg++)
+	{
+		lcam_ae.gain[seg] = 15;
+		lcam_ae.offset[seg] = 0;
+	}
+	lcam_ae_mode = LCAM_AE_ON;
+	lcam_ae_dirty = 1;
+	SREG = sreg;
+}
+
+unsigned int lcam_ae_update(const unsigned char *image)
+{
+	if(lcam_ae_mode != LCAM_AE_OFF)
+	{
+		lcam_ae_frame(image);
+	}
+	return lcam_ae.exposure_us;
+}
+
+void lcam_ae_lock(unsigned char lock)
+{
+	if(lcam_ae_mode != LCAM_AE_OFF)
+	{
+		lcam_ae_mode = lock ? LCAM_AE_LOCKED : LCAM_AE_ON;
+	}
+}
+
+void lcam_ae_get(lcam_ae_t *settings)
+{
+	unsigned char sreg = SREG;
+
+	cli();
+	*settings = lcam_ae;
+	SREG = sreg;
+}
+
+
+//-----Analyse pendant la lecture
+
+// Barycentre des pixels contigus au-dessus de half autour de top, en 1/256 de pixel
+static unsigned int lcam_centroid(const unsigned char *image, unsigned char top, unsigned char half)
+{
+	unsigned char first = top, last = top, i;
+	unsigned long moment = 0;
+	unsigned int weight = 0, w;
+
+	while(first > 0 && top - first < LCAM_PEAK_WIDTH && image[first - 1] > half)
+	{
+		first--;
+	}
+	while(last < LCAM_PIXELS - 1 && last - top < LCAM_PEAK_WIDTH && image[last + 1] > half)
+	{
+		last++;
+	}
+
+	for(i = first; i <= last; i++)
+	{
+		if(image[i] > half)
+		{
+			w = image[i] - half;
+			weight += w;
+			moment += (unsigned long)w * i;
+		}
+	}
+
+	if(weight == 0)
+	{
+		return (unsigned int)top << 8;
+	}
+	return ((moment << 8) + weight/2) / weight;
+}
+
+// Pics: zones plus lumineuses que leurs voisines, dont le maximum dépasse la mi-hauteur
+static void lcam_peaks(const unsigned char *image, lcam_stats_t *stats)
+{
+	unsigned char half = stats->min + (stats->max - stats->min)/2;
+	unsigned int threshold = (unsigned int)stats->min * LCAM_ZONE_SIZE + (stats->max - stats->min)/2;
+	unsigned char second = stats->min;
+	unsigned char zone, i, end, top, previous = 0xFF;
+
+	stats->peaks = 0;
+	stats->confidence = 0;
+	stats->position = (unsigned int)stats->maxpos << 8;
+	if(stats->max - stats->min < LCAM_MIN_CONTRAST)
+	{
+		return;
+	}
+	stats->position = lcam_centroid(image, stats->maxpos, half);
+
+	for(zone = 0; zone < LCAM_ZONES; zone++)
+	{
+		if(stats->zones[zone] <= threshold
+			|| (zone > 0 && stats->zones[zone] < stats->zones[zone - 1])
+			|| (zone < LCAM_ZONES - 1 && stats->zones[zone] <= stats->zones[zone + 1]))
+		{
+			continue;
+		}
+
+		// maximum de la zone et de ses voisines, pour un pic à cheval sur deux zones
+		i = (zone > 0) ? (zone - 1)*LCAM_ZONE_SIZE + 1 : 1;
+		end = (zone < LCAM_ZONES - 1) ? (zone + 2)*LCAM_ZONE_SIZE + 1 : LCAM_ZONES*LCAM_ZONE_SIZE + 1;
+		for(top = i; i < end; i++)
+		{
+			if(image[i] > image[top])
+			{
+				top = i;
+			}
+		}
+		if(top == previous || image[top] <= half)
+		{
+			continue;
+		}
+		previous = top;
+
+		if(stats->peaks < LCAM_PEAKS)
+		{
+			stats->peak[stats->peaks] = (top == stats->maxpos) ? stats->position : lcam_centroid(image, top, half);
+		}
+		stats->peaks++;
+		if(top != stats->maxpos && image[top] > second)
+		{
+			second = image[top];
+		}
+	}
+
+	stats->confidence = stats->max - second;
+}
+
+// image est lue sur la caméra si live, sinon analysée en mémoire
+static void lcam_scan(unsigned char *image, lcam_stats_t *stats, unsigned char live)
+{
+	unsigned char i, pixel, count = 0, zone = 0;
+	unsigned char min = 255, max = 0, maxpos = 0;
+	unsigned int sum = 0;
+
+	for(i = 0; i < LCAM_PIXELS; i++)
+	{
+		if(live)
+		{
+			pixel = lcam_readpixel();
+			image[i] = pixel;
+		}
+		else
+		{
+			pixel = image[i];
+		}
+
+		if(pixel < min)
+		{
+			min = pixel;
+		}
+		if(pixel > max)
+		{
+			max = pixel;
+			maxpos = i;
+		}
+		if(i > 0 && zone < LCAM_ZONES)
+		{
+			sum += pixel;
+			if(++count == LCAM_ZONE_SIZE)
+			{
+				stats->zones[zone++] = sum;
+				sum = 0;
+				count = 0;
+			}
+		}
+	}
+
+	stats->min = min;
+	stats->max = max;
+	stats->maxpos = maxpos;
+	lcam_peaks(image, stats);
+}
+
+// Reset complétement la caméra si elle a planté
+static void lcam_recover(void)
+{
+	lcam_reset();
+	lcam_setup();
+	if(lcam_ae_mode != LCAM_AE_OFF)
+	{
+		lcam_ae_write();
+	}
+}
+
+// Fin d'intégration et lecture (analysée si stats != 0), retourne 0 si l'image a été lue
+static unsigned char lcam_fetch(unsigned char *image, lcam_stats_t *stats){
 
 		lcam_endintegration();
 
 		if(lcam_readout() != 0)
 		{
-			// Reset complétement la caméra si elle a planté
-			lcam_reset();
-			lcam_setup();
+			lcam_recover();
+			if(stats)
+			{
+				stats->confidence = 0;
+				stats->peaks = 0;
+			}
+			return 1;
+		}
+
+		// Sinon on lit les pixels
+		if(stats)
+		{
+			lcam_scan(image, stats, 1);
 		}
 		else
 		{
-			// Sinon on lit les pixels
 			lcam_read(image);
 		}
+		return 0;
+}
+
+void lcam_stop(unsigned char *image){
+
+		lcam_fetch(image, 0);
+
+}
+
+
+void lcam_stop_stats(unsigned char *image, lcam_stats_t *stats){
+
+		lcam_fetch(image, stats);
+
+}
+
+void lcam_analyse(const unsigned char *image, lcam_stats_t *stats)
+{
+	lcam_scan((unsigned char *)image, stats, 0);
+}
+
+// Au-delà de ce nombre de pixels restants, interrompre l'envoi est plus court que les passer
+#define LCAM_ROI_ABORT	6
+
+unsigned char lcam_stop_roi(unsigned char *image, unsigned char start, unsigned char length)
+{
+	unsigned char rest;
+
+	if(start > LCAM_PIXELS)
+	{
+		start = LCAM_PIXELS;
+	}
+	if(length > LCAM_PIXELS - start)
+	{
+		length = LCAM_PIXELS - start;
+	}
+
+	lcam_endintegration();
+
+	if(lcam_readout() != 0)
+	{
+		lcam_recover();
+		return 1;
+	}
+
+	lcam_skippixels(start);
+	lcam_readn(image + start, length);
+
+	rest = LCAM_PIXELS - start - length;
+	if(rest > LCAM_ROI_ABORT)
+	{
+		lcam_resync();
+	}
+	else
+	{
+		lcam_skippixels(rest);
+	}
+	return 0;
+}
+
+#ifdef LCAM_SDOUT2
+void lcam_stop2(unsigned char *image, unsigned char *image2)
+{
+	lcam_endintegration();
+
+	if(lcam_readout2() != 0)
+	{
+		lcam_recover();
+		return;
+	}
+	lcam_read2(image, image2);
+}
+#endif
+
+
+#ifndef notimer
+//-----Acquisition asynchrone
+//Le timer 0 (voir timerAlarm dans robopoly.c) enchaîne: début d'intégration -> fin d'intégration et lecture
+//dans le buffer libre -> attente jusqu'à l'image suivante. La lecture se fait dans l'interruption, interruptions actives;
+//les callbacks de l'agenda ne s'y imbriquent pas (ils attendent le tick suivant la fin de l'alarme).
+
+enum {LCAM_ASYNC_OFF, LCAM_ASYNC_START, LCAM_ASYNC_INTEGRATE};
+
+#define LCAM_NONE	0xFF
+
+static unsigned char *lcam_buffers;			// 2 x LCAM_PIXELS fournis par l'utilisateur
+static volatile unsigned char lcam_state = LCAM_ASYNC_OFF;
+static volatile unsigned char lcam_front = LCAM_NONE;	// buffer rendu par lcam_acquire_frame
+static volatile unsigned char lcam_latest = LCAM_NONE;	// buffer contenant la dernière image complète
+static volatile unsigned char lcam_ready = 0;			// nouvelle image pas encore prise
+static volatile unsigned char lcam_errors = 0;
+static volatile unsigned int lcam_exposure;	// pas de 8us
+static volatile unsigned int lcam_gap;			// pas de 8us entre la lecture et l'intégration suivante
+static unsigned int lcam_period;				// pas de 8us entre deux débuts d'intégration
+
+// A appeler interruptions désactivées
+static void lcam_async_exposure(unsigned int exposure_us)
+{
+	unsigned int exposure = exposure_us / 8;
+
+	if(exposure < 2)
+	{
+		exposure = 2;
+	}
+	lcam_exposure = exposure;
+	lcam_gap = (lcam_period > exposure + 2) ? lcam_period - exposure : 2;
+}
+
+static void lcam_async_step(void)
+{
+	unsigned char target;
+
+	if(lcam_state == LCAM_ASYNC_START)
+	{
+		lcam_startintegration();
+		lcam_state = LCAM_ASYNC_INTEGRATE;
+		timerAlarm(lcam_exposure, lcam_async_step);
+		return;
+	}
+
+	if(lcam_state != LCAM_ASYNC_INTEGRATE)
+	{
+		return;
+	}
+
+	// le buffer gardé par le programme principal n'est jamais écrit, une image non prise est écrasée
+	target = (lcam_front == 1) ? 0 : 1;
+	lcam_ready = 0;
+	if(lcam_latest == target)
+	{
+		lcam_latest = lcam_front;
+	}
+	sei();	// la lecture prend ~1.5ms, les autres interruptions restent servies
+
+	if(lcam_fetch(lcam_buffers + target*LCAM_PIXELS, 0) == 0)
+	{
+		if(lcam_ae_mode != LCAM_AE_OFF)
+		{
+			lcam_ae_frame(lcam_buffers + target*LCAM_PIXELS);
+		}
+		cli();
+		lcam_latest = target;
+		lcam_ready = 1;
+		if(lcam_ae_mode != LCAM_AE_OFF)
+		{
+			lcam_async_exposure(lcam_ae.exposure_us);
+		}
+	}
+	else
+	{
+		cli();
+		lcam_errors++;
+	}
+
+	if(lcam_state == LCAM_ASYNC_INTEGRATE)
+	{
+		lcam_state = LCAM_ASYNC_START;
+		timerAlarm(lcam_gap, lcam_async_step);
+	}
+}
+
+void lcam_async_start(unsigned char *buffers, unsigned int exposure_us, unsigned int period_ms)
+{
+	lcam_async_stop();
+
+	lcam_buffers = buffers;
+	lcam_front = LCAM_NONE;
+	lcam_latest = LCAM_NONE;
+	lcam_ready = 0;
+	lcam_async_timing(exposure_us, period_ms);
+
+	lcam_state = LCAM_ASYNC_START;
+	timerAlarm(2, lcam_async_step);
+	sei();
+}
+
+void lcam_async_timing(unsigned int exposure_us, unsigned int period_ms)
+{
+	unsigned long period = (unsigned long)period_ms * 125;
+	unsigned char sreg = SREG;
+
+	if(period > 65535)
+	{
+		period = 65535;
+	}
+
+	cli();
+	lcam_period = period;
+	lcam_async_exposure((lcam_ae_mode != LCAM_AE_OFF) ? lcam_ae.exposure_us : exposure_us);
+	SREG = sreg;
+}
+
+void lcam_async_stop(void)
+{
+	unsigned char sreg = SREG;
+
+	cli();
+	if(lcam_state != LCAM_ASYNC_OFF)
+	{
+		lcam_state = LCAM_ASYNC_OFF;
+		timerAlarmCancel();
+	}
+	SREG = sreg;
+}
+
+unsigned char lcam_frame_ready(void)
+{
+	return lcam_ready;
+}
+
+unsigned char *lcam_acquire_frame(void)
+{
+	unsigned char sreg = SREG;
+	unsigned char *frame = 0;
+
+	cli();
+	if(lcam_latest != LCAM_NONE)
+	{
+		lcam_front = lcam_latest;
+		lcam_ready = 0;
+		frame = lcam_buffers + lcam_front*LCAM_PIXELS;
+	}
+	SREG = sreg;
+	return frame;
+}
 
+unsigned char lcam_async_errors(void)
+{
+	return lcam_errors;
 }
+#endif
 
@@ -0,0 +1,619 @@
+/***************************************************************************************
+ *
+ * Analyse sur PC d'images enregistrées de la caméra linéaire
+ * Fichier: lcamtool.c
+ *
+ * Rejoue des enregistrements d'images sur lcam_getpic (mêmes résultats, bit à bit, que
+ * lcam.S) et sur des détecteurs paramétrables, puis compare leurs détections à celles de
+ * lcam_getpic. Les fichiers sont projetés en mémoire, les images réparties entre les
+ * threads et les noyaux de calcul écrits avec les vecteurs de gcc (SSE2, NEON...).
+ *
+ * Format des fichiers (écrits par telemetry.py -l, valeurs LSB d'abord):
+ *  - en-tête de 16 bytes: "LCAMLOG1", nombre de pixels (16 bits, 102),
+ *    taille d'un enregistrement (16 bits, 112), 4 bytes réservés;
+ *  - enregistrements de 112 bytes: 102 pixels, 2 bytes réservés,
+ *    temps (32 bits, ticks de 2.048ms), numéro de l'image (32 bits).
+ *
+ * Détecteurs (position de la ligne en pixels, ou rien si le contraste est insuffisant):
+ *  - getpic: lcam_getpic, zone retournée k -> centre des pixels 4k+1 à 4k+4. Comme lcam.S,
+ *    la zone des pixels 1 à 4 n'est jamais considérée et la zone 25 est le pixel 25 brut;
+ *  - getpic_vec: la même chose en vectoriel, doit être identique à getpic;
+ *  - zones Z/C: zones de Z pixels à partir du pixel 1, la plus lumineuse si l'écart de
+ *    moyenne entre la plus lumineuse et la plus sombre atteint C;
+ *  - centroid C: barycentre à mi-hauteur autour du pixel le plus lumineux, comme
+ *    lcam_analyse (lcamc.c), si max-min atteint C.
+ *
+ * Exemples:
+ *   lcamtool run1.lcam run2.lcam                 valeurs par défaut (zones 4/11, centroid 11)
+ *   lcamtool -z 2,4,8 -c 5,11,20 -j 8 run.lcam   balayage taille de zone x contraste
+ *   lcamtool -g 1000000 synth.lcam               génère des images synthétiques
+ *
+ * Compilation: gcc -O2 -pthread lcamtool.c -o lcamtool (voir "make lcamtool")
+ *
+ ***************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define LOG_MAGIC		"LCAMLOG1"
+#define LOG_HEADER		16
+#define LOG_RECORD		112
+#define PIXELS			102
+
+#define MAX_PARAMS		16
+#define MAX_DETECTORS	(2 + MAX_PARAMS*MAX_PARAMS + MAX_PARAMS)	// getpic, getpic_vec, zones, centroid
+#define MAX_THREADS		256
+
+#define NONE			(-1)			// pas de ligne détectée
+#define PEAK_WIDTH		4				// LCAM_PEAK_WIDTH
+
+typedef unsigned char v16u8 __attribute__((vector_size(16)));
+typedef unsigned int v4u32 __attribute__((vector_size(16)));
+
+enum {DET_GETPIC, DET_GETPIC_VEC, DET_ZONES, DET_CENTROID};
+
+typedef struct
+{
+	int kind;
+	int zone;			// pixels par zone (DET_ZONES)
+	int contrast;		// contraste minimal
+	char name[32];
+} detector;
+
+typedef struct
+{
+	unsigned long long detected;	// images avec une ligne
+	unsigned long long agree;		// même décision que getpic, à tolérance près
+	unsigned long long both;		// images où getpic et le détecteur voient une ligne
+	unsigned long long same;		// position identique à celle de getpic
+	double error;					// somme des écarts de position avec getpic (both)
+	double seconds;					// temps de calcul (somme des threads)
+} result;
+
+typedef struct
+{
+	pthread_t thread;
+	size_t first, count;
+	result results[MAX_DETECTORS];
+} worker;
+
+static const unsigned char **frames;
+static size_t frameCount;
+static detector detectors[MAX_DETECTORS];
+static int detectorCount;
+static double tolerance = 4.0;
+
+static double now(int clock)
+{
+	struct timespec t;
+
+	clock_gettime(clock, &t);
+	return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+// Les positions sont en 1/256 pixel
+static int zoneCenter(int first, int size)
+{
+	return first*256 + (size - 1)*128;
+}
+
+/* lcam_getpic instruction par instruction: sommes 8 bits de pixel>>2 écrites sur image[0..24],
+   puis recherche sur image[1..25]: le dernier maximum l'emporte, le minimum est strict. */
+static int getpicZone(const unsigned char *frame)
+{
+	unsigned char image[PIXELS];
+	unsigned char group, max = 0, min = 0xFF, zone = 0;
+	int g, i;
+
+	memcpy(image, frame, PIXELS);
+	for(g = 0; g < 25; g++)
+	{
+		group = 0;
+		for(i = 0; i < 4; i++)
+		{
+			group += image[1 + 4*g + i] >> 2;
+		}
+		image[g] = group;
+	}
+	for(i = 1; i <= 25; i++)
+	{
+		if(image[i] >= max)
+		{
+			max = image[i];
+			zone = i;
+		}
+		if(image[i] < min)
+		{
+			min = image[i];
+		}
+	}
+	return (unsigned char)(max - min) >= 11 ? zone : 0;
+}
+
+static int getpicPosition(int zone)
+{
+	return zone ? zoneCenter(4*zone + 1, 4) : NONE;
+}
+
+// Version vectorielle: les 4 pixels d'une zone sont les 4 bytes d'un mot de 32 bits
+static int getpicZoneVec(const unsigned char *frame)
+{
+	v16u8 pixels[7];
+	v4u32 sums[7];
+	unsigned int *s = (unsigned int *)sums;
+	unsigned char max = 0, min = 0xFF, zone = 0, value;
+	int i;
+
+	memset(pixels, 0, sizeof(pixels));
+	memcpy(pixels, frame + 1, PIXELS - 2);
+	for(i = 0; i < 7; i++)
+	{
+		v4u32 w = (v4u32)(pixels[i] >> 2);
+		sums[i] = (w & 0xFF) + ((w >> 8) & 0xFF) + ((w >> 16) & 0xFF) + (w >> 24);
+	}
+	s[25] = frame[25];		// lcam.S lit un byte de trop, qui n'a pas été remplacé par une somme
+
+	for(i = 1; i <= 25; i++)
+	{
+		value = s[i];
+		if(value >= max)
+		{
+			max = value;
+			zone = i;
+		}
+		if(value < min)
+		{
+			min = value;
+		}
+	}
+	return (unsigned char)(max - min) >= 11 ? zone : 0;
+}
+
+// Pas d'opérateur ?: sur les vecteurs en C: sélection par masque
+static v16u8 vmin(v16u8 a, v16u8 b)
+{
+	v16u8 mask = (v16u8)(a < b);
+
+	return (a & mask) | (b & ~mask);
+}
+
+static v16u8 vmax(v16u8 a, v16u8 b)
+{
+	v16u8 mask = (v16u8)(a > b);
+
+	return (a & mask) | (b & ~mask);
+}
+
+// Minimum, maximum et premier pixel du maximum, par blocs de 16 pixels
+static void minMax(const unsigned char *frame, int *min, int *max, int *maxpos)
+{
+	v16u8 block, lo, hi;
+	unsigned char m = 0xFF, M = 0;
+	int i;
+
+	memcpy(&block, frame, 16);
+	lo = hi = block;
+	for(i = 16; i + 16 <= PIXELS; i += 16)
+	{
+		memcpy(&block, frame + i, 16);
+		lo = vmin(lo, block);
+		hi = vmax(hi, block);
+	}
+	memcpy(&block, frame + PIXELS - 16, 16);		// les derniers pixels, en partie déjà vus
+	lo = vmin(lo, block);
+	hi = vmax(hi, block);
+	for(i = 0; i < 16; i++)
+	{
+		m = lo[i] < m ? lo[i] : m;
+		M = hi[i] > M ? hi[i] : M;
+	}
+	*min = m;
+	*max = M;
+	*maxpos = (const unsigned char *)memchr(frame, M, PIXELS) - frame;
+}
+
+static int zonesPosition(const unsigned char *frame, int size, int contrast)
+{
+	int zones = (PIXELS - 2) / size;
+	int z, i, sum, best = 0, bestSum = -1, worstSum = 1 << 30;
+
+	for(z = 0; z < zones; z++)
+	{
+		sum = 0;
+		for(i = 1 + z*size; i < 1 + (z + 1)*size; i++)
+		{
+			sum += frame[i];
+		}
+		if(sum > bestSum)
+		{
+			bestSum = sum;
+			best = z;
+		}
+		if(sum < worstSum)
+		{
+			worstSum = sum;
+		}
+	}
+	if(bestSum - worstSum < contrast*size)
+	{
+		return NONE;
+	}
+	return zoneCenter(1 + best*size, size);
+}
+
+// Comme lcam_centroid (lcamc.c)
+static int centroidPosition(const unsigned char *frame, int contrast)
+{
+	int min, max, top, half, first, last, i, w, weight = 0;
+	long moment = 0;
+
+	minMax(frame, &min, &max, &top);
+	if(max - min < contrast)
+	{
+		return NONE;
+	}
+	half = min + (max - min)/2;
+	for(first = top; first > 0 && top - first < PEAK_WIDTH && frame[first - 1] > half; first--)
+	{
+	}
+	for(last = top; last < PIXELS - 1 && last - top < PEAK_WIDTH && frame[last + 1] > half; last++)
+	{
+	}
+	for(i = first; i <= last; i++)
+	{
+		if(frame[i] > half)
+		{
+			w = frame[i] - half;
+			weight += w;
+			moment += (long)w * i;
+		}
+	}
+	return ((moment << 8) + weight/2) / weight;
+}
+
+static int detect(const detector *d, const unsigned char *frame)
+{
+	switch(d->kind)
+	{
+		case DET_GETPIC:
+			return getpicPosition(getpicZone(frame));
+		case DET_GETPIC_VEC:
+			return getpicPosition(getpicZoneVec(frame));
+		case DET_ZONES:
+			return zonesPosition(frame, d->zone, d->contrast);
+		default:
+			return centroidPosition(frame, d->contrast);
+	}
+}
+
+static void *work(void *arg)
+{
+	worker *w = arg;
+	int *reference = malloc(w->count * sizeof(int));
+	int d, position;
+	size_t n;
+	double start, diff;
+
+	// getpic d'abord: c'est la référence des autres
+	for(d = 0; d < detectorCount; d++)
+	{
+		result *r = &w->results[d];
+
+		start = now(CLOCK_THREAD_CPUTIME_ID);
+		for(n = 0; n < w->count; n++)
+		{
+			position = detect(&detectors[d], frames[w->first + n]);
+			if(d == 0)
+			{
+				reference[n] = position;
+			}
+			if(position != NONE)
+			{
+				r->detected++;
+			}
+			r->same += (position == reference[n]);
+			if(position == NONE || reference[n] == NONE)
+			{
+				r->agree += (position == reference[n]);
+				continue;
+			}
+			diff = (position - reference[n]) / 256.0;
+			diff = diff < 0 ? -diff : diff;
+			r->both++;
+			r->error += diff;
+			r->agree += (diff <= tolerance);
+		}
+		r->seconds = now(CLOCK_THREAD_CPUTIME_ID) - start;
+	}
+	free(reference);
+	return NULL;
+}
+
+static int parseList(const char *s, int *values)
+{
+	int n = 0;
+	char *end;
+
+	while(*s && n < MAX_PARAMS)
+	{
+		values[n] = strtol(s, &end, 0);
+		if(end == s || values[n] <= 0)
+		{
+			return -1;
+		}
+		n++;
+		s = (*end == ',') ? end + 1 : end;
+	}
+	return *s ? -1 : n;
+}
+
+static void put32(unsigned char *p, unsigned long v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static void writeHeader(FILE *f)
+{
+	unsigned char header[LOG_HEADER] = LOG_MAGIC;
+
+	header[8] = PIXELS;
+	header[10] = LOG_RECORD;
+	fwrite(header, 1, LOG_HEADER, f);
+}
+
+// Images synthétiques: fond bruité, ligne de largeur et de contraste variables, parfois absente
+static int generate(const char *name, unsigned long count)
+{
+	unsigned char record[LOG_RECORD];
+	unsigned long n, seed = 12345;
+	int i, center, width, height, background, v;
+	FILE *f = fopen(name, "wb");
+
+	if(!f)
+	{
+		perror(name);
+		return 1;
+	}
+	writeHeader(f);
+#define RANDOM(m)	((seed = seed*1103515245 + 12345) >> 16) % (m)
+	for(n = 0; n < count; n++)
+	{
+		memset(record, 0, sizeof(record));
+		background = 10 + RANDOM(60);
+		center = RANDOM(PIXELS*4);
+		width = 1 + RANDOM(6);
+		height = (RANDOM(8) == 0) ? RANDOM(12) : 10 + RANDOM(180);
+		for(i = 0; i < PIXELS; i++)
+		{
+			v = background + RANDOM(9) - 4;
+			if(abs(i*4 - center) < width*4)
+			{
+				v += height - height*abs(i*4 - center)/(width*4);
+			}
+			record[i] = v < 0 ? 0 : v > 255 ? 255 : v;
+		}
+		put32(record + 104, n * 10);
+		put32(record + 108, n);
+		fwrite(record, 1, LOG_RECORD, f);
+	}
+#undef RANDOM
+	if(fclose(f))
+	{
+		perror(name);
+		return 1;
+	}
+	return 0;
+}
+
+static int load(const char *name)
+{
+	struct stat st;
+	const unsigned char *map;
+	size_t n, count;
+	int fd = open(name, O_RDONLY);
+
+	if(fd < 0 || fstat(fd, &st) < 0)
+	{
+		perror(name);
+		return -1;
+	}
+	if(st.st_size < LOG_HEADER)
+	{
+		fprintf(stderr, "%s: fichier trop court\n", name);
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+	{
+		perror(name);
+		return -1;
+	}
+	if(memcmp(map, LOG_MAGIC, 8) || (map[8] | map[9] << 8) != PIXELS || (map[10] | map[11] << 8) != LOG_RECORD)
+	{
+		fprintf(stderr, "%s: pas un enregistrement lcam de %d pixels\n", name, PIXELS);
+		return -1;
+	}
+	madvise((void *)map, st.st_size, MADV_SEQUENTIAL | MADV_WILLNEED);
+
+	count = (st.st_size - LOG_HEADER) / LOG_RECORD;
+	if((st.st_size - LOG_HEADER) % LOG_RECORD)
+	{
+		fprintf(stderr, "%s: dernier enregistrement incomplet ignoré\n", name);
+	}
+	frames = realloc(frames, (frameCount + count) * sizeof(*frames));
+	for(n = 0; n < count; n++)
+	{
+		frames[frameCount++] = map + LOG_HEADER + n*LOG_RECORD;
+	}
+	return 0;
+}
+
+static void addDetector(int kind, int zone, int contrast, const char *name)
+{
+	detector *d;
+
+	if(detectorCount >= MAX_DETECTORS)
+	{
+		fprintf(stderr, "trop de détecteurs (%d au plus)\n", MAX_DETECTORS);
+		exit(2);
+	}
+	d = &detectors[detectorCount++];
+	d->kind = kind;
+	d->zone = zone;
+	d->contrast = contrast;
+	snprintf(d->name, sizeof(d->name), "%s", name);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: lcamtool [-j threads] [-z zones] [-c contrastes] [-t tolérance] fichier...\n"
+		"       lcamtool -g images fichier\n"
+		"  -j n      threads (défaut: tous les processeurs)\n"
+		"  -z 2,4,8  tailles de zone à essayer (défaut: 4)\n"
+		"  -c 5,11   contrastes minimaux à essayer, zones et centroid (défaut: 11)\n"
+		"  -t px     écart de position toléré avec getpic (défaut: 4)\n"
+		"  -g n      écrit n images synthétiques dans fichier\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	int zones[MAX_PARAMS] = {4}, contrasts[MAX_PARAMS] = {11};
+	int zoneCount = 1, contrastCount = 1;
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned long synthetic = 0;
+	worker *workers;
+	double start, wall;
+	size_t mismatch = 0;
+	char name[32];
+	int opt, i, j, d;
+
+	while((opt = getopt(argc, argv, "j:z:c:t:g:")) != -1)
+	{
+		switch(opt)
+		{
+			case 'j':
+				threads = atoi(optarg);
+				break;
+			case 'z':
+				zoneCount = parseList(optarg, zones);
+				break;
+			case 'c':
+				contrastCount = parseList(optarg, contrasts);
+				break;
+			case 't':
+				tolerance = atof(optarg);
+				break;
+			case 'g':
+				synthetic = strtoul(optarg, NULL, 0);
+				break;
+			default:
+				usage();
+		}
+	}
+	if(optind >= argc || zoneCount <= 0 || contrastCount <= 0 || threads <= 0)
+	{
+		usage();
+	}
+	if(synthetic)
+	{
+		return (argc - optind == 1) ? generate(argv[optind], synthetic) : (usage(), 2);
+	}
+	if(threads > MAX_THREADS)
+	{
+		threads = MAX_THREADS;
+	}
+
+	for(i = optind; i < argc; i++)
+	{
+		if(load(argv[i]) < 0)
+		{
+			return 1;
+		}
+	}
+	if(!frameCount)
+	{
+		fprintf(stderr, "aucune image\n");
+		return 1;
+	}
+
+	addDetector(DET_GETPIC, 4, 11, "getpic");
+	addDetector(DET_GETPIC_VEC, 4, 11, "getpic_vec");
+	for(i = 0; i < zoneCount; i++)
+	{
+		for(j = 0; j < contrastCount; j++)
+		{
+			snprintf(name, sizeof(name), "zones %d/%d", zones[i], contrasts[j]);
+			addDetector(DET_ZONES, zones[i], contrasts[j], name);
+		}
+	}
+	for(j = 0; j < contrastCount; j++)
+	{
+		snprintf(name, sizeof(name), "centroid %d", contrasts[j]);
+		addDetector(DET_CENTROID, 0, contrasts[j], name);
+	}
+
+	if((size_t)threads > frameCount)
+	{
+		threads = frameCount;
+	}
+	workers = calloc(threads, sizeof(worker));
+	start = now(CLOCK_MONOTONIC);
+	for(i = 0; i < threads; i++)
+	{
+		workers[i].first = frameCount * i / threads;
+		workers[i].count = frameCount * (i + 1) / threads - workers[i].first;
+		pthread_create(&workers[i].thread, NULL, work, &workers[i]);
+	}
+	for(i = 0; i < threads; i++)
+	{
+		pthread_join(workers[i].thread, NULL);
+	}
+	wall = now(CLOCK_MONOTONIC) - start;
+
+	printf("# %zu images, %d threads, %.3fs, %.0f images/s par détecteur\n",
+		frameCount, threads, wall, frameCount * detectorCount / wall);
+	printf("detector\tdetected%%\tagree%%\tmean_error_px\tns_per_frame\n");
+	for(d = 0; d < detectorCount; d++)
+	{
+		result r;
+
+		memset(&r, 0, sizeof(r));
+		for(i = 0; i < threads; i++)
+		{
+			r.detected += workers[i].results[d].detected;
+			r.agree += workers[i].results[d].agree;
+			r.both += workers[i].results[d].both;
+			r.same += workers[i].results[d].same;
+			r.error += workers[i].results[d].error;
+			r.seconds += workers[i].results[d].seconds;
+		}
+		printf("%s\t%.2f\t%.2f\t%.2f\t%.1f\n", detectors[d].name,
+			100.0 * r.detected / frameCount, 100.0 * r.agree / frameCount,
+			r.both ? r.error / r.both : 0.0, r.seconds * 1e9 / frameCount);
+		if(d == DET_GETPIC_VEC && r.same != frameCount)
+		{
+			mismatch = frameCount - r.same;
+		}
+	}
+	free(workers);
+
+	if(mismatch)
+	{
+		fprintf(stderr, "getpic_vec diffère de getpic sur %zu images\n", mismatch);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,369 @@
+/***************************************************************************************
+ *
+ * Paramètres réglables en EEPROM
+ * Fichier: param.c
+ *
+ * Un enregistrement: numéro (16 bits), valeurs, CRC-16 (_crc_ccitt_update, qui commence
+ * par PARAM_VERSION et la taille des valeurs). Les enregistrements se suivent dans une
+ * zone tournante; le valide de plus grand numéro est le bon.
+ * L'interruption EE_RDY écrit une copie du cache faite par paramSave, jamais le cache.
+ *
+ ***************************************************************************************/
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+#include <util/crc16.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "robopoly.h"
+#include "param.h"
+
+#define PARAM_SEQ		2
+#define PARAM_RECORD	(PARAM_SEQ + sizeof(paramValues) + 2)	// numéro, valeurs, CRC
+#define PARAM_SLOTS		(PARAM_EEPROM_SIZE / PARAM_RECORD)
+#define PARAM_SIGNED	0x80
+
+typedef char paramCheckSlots[(PARAM_SLOTS >= 2 && PARAM_RECORD < 256) ? 1 : -1];	// PARAM_EEPROM_SIZE trop petite
+
+typedef struct
+{
+	PGM_P name;
+	unsigned char offset;
+	unsigned char size;			// bytes, | PARAM_SIGNED
+} paramInfo;
+
+#define PARAM(name, type, value)	static const char paramName_##name[] PROGMEM = #name;
+#include "paramdef.h"
+#undef PARAM
+
+static const paramInfo paramInfos[PARAM_COUNT] PROGMEM =
+{
+#define PARAM(name, type, value)	{paramName_##name, offsetof(paramValues, name), sizeof(type) | (((type)-1 < 0) ? PARAM_SIGNED : 0)},
+#include "paramdef.h"
+#undef PARAM
+};
+
+static const paramValues paramDefault PROGMEM =
+{
+#define PARAM(name, type, value)	value,
+#include "paramdef.h"
+#undef PARAM
+};
+
+paramValues param;
+
+static unsigned char paramEeprom[PARAM_SLOTS][PARAM_RECORD] EEMEM;
+static unsigned char paramSlot;				// dernier enregistrement écrit ou lu
+static unsigned int paramSeq;
+
+static unsigned char paramRecord[PARAM_RECORD];	// en cours d'écriture
+static unsigned char *paramAddress;				// en EEPROM
+static unsigned char paramPos;
+static volatile unsigned char paramWriting = 0;
+
+static char paramLine[PARAM_LINE];
+static unsigned char paramLength = 0;		// PARAM_LINE: ligne trop longue, ignorée jusqu'à la fin
+
+static unsigned int paramCrcStart(void)
+{
+	unsigned int crc = 0xFFFF;
+
+	crc = _crc_ccitt_update(crc, PARAM_VERSION);
+	return _crc_ccitt_update(crc, sizeof(paramValues));
+}
+
+unsigned char paramInit(void)
+{
+	unsigned char slot, i, found = 0;
+	unsigned int crc, seq;
+	const unsigned char *p;
+
+	for(slot = 0; slot < PARAM_SLOTS; slot++)
+	{
+		p = paramEeprom[slot];
+		crc = paramCrcStart();
+		for(i = 0; i < PARAM_RECORD - 2; i++)
+		{
+			crc = _crc_ccitt_update(crc, eeprom_read_byte(p + i));
+		}
+		if(crc != (eeprom_read_byte(p + i) | (unsigned int)eeprom_read_byte(p + i + 1) << 8))
+		{
+			continue;
+		}
+		seq = eeprom_read_byte(p) | (unsigned int)eeprom_read_byte(p + 1) << 8;
+		if(!found || (int)(seq - paramSeq) > 0)
+		{
+			found = 1;
+			paramSlot = slot;
+			paramSeq = seq;
+		}
+	}
+
+	if(!found)
+	{
+		paramSlot = PARAM_SLOTS - 1;
+		paramSeq = 0;
+		paramDefaults();
+		return 0;
+	}
+	eeprom_read_block(&param, paramEeprom[paramSlot] + PARAM_SEQ, sizeof(param));
+	return 1;
+}
+
+void paramDefaults(void)
+{
+	unsigned char sreg = SREG;
+
+	cli();
+	memcpy_P(&param, &paramDefault, sizeof(param));
+	SREG = sreg;
+}
+
+unsigned char paramSave(void)
+{
+	unsigned char sreg = SREG;
+	unsigned int crc = paramCrcStart();
+	unsigned char i;
+
+	if(paramWriting)
+	{
+		return 0;
+	}
+
+	paramSeq++;
+	paramSlot = (paramSlot + 1 < PARAM_SLOTS) ? paramSlot + 1 : 0;
+	paramRecord[0] = paramSeq & 0xFF;
+	paramRecord[1] = paramSeq >> 8;
+	cli();
+	memcpy(paramRecord + PARAM_SEQ, &param, sizeof(param));	// copie cohérente même si une interruption modifie param
+	SREG = sreg;
+
+	for(i = 0; i < PARAM_RECORD - 2; i++)
+	{
+		crc = _crc_ccitt_update(crc, paramRecord[i]);
+	}
+	paramRecord[PARAM_RECORD - 2] = crc & 0xFF;
+	paramRecord[PARAM_RECORD - 1] = crc >> 8;
+
+	paramAddress = paramEeprom[paramSlot];
+	paramPos = 0;
+	paramWriting = 1;
+	EECR |= (1<<EERIE);
+	return 1;
+}
+
+unsigned char paramBusy(void)
+{
+	return paramWriting;
+}
+
+// Appelée dès que l'EEPROM est libre: un byte par appel, les bytes inchangés sont passés
+ISR(EE_RDY_vect)
+{
+	unsigned char value;
+
+	ISR_STATS_BEGIN(0)
+	ISR_WAKE()
+	while(1)
+	{
+		if(paramPos >= PARAM_RECORD)
+		{
+			EECR &= ~(1<<EERIE);
+			paramWriting = 0;
+			break;
+		}
+		EEAR = (unsigned int)(paramAddress + paramPos);
+		value = paramRecord[paramPos++];
+		EECR |= (1<<EERE);
+		if(EEDR != value)
+		{
+			EEDR = value;
+			EECR |= (1<<EEMWE);
+			EECR |= (1<<EEWE);		// moins de 4 cycles après EEMWE
+			break;
+		}
+	}
+	ISR_STATS_END(ISR_STATS_EE_RDY, 0)
+}
+
+signed char paramFind(const char *name)
+{
+	unsigned char i;
+
+	for(i = 0; i < PARAM_COUNT; i++)
+	{
+		if(!strcmp_P(name, (PGM_P)pgm_read_word(&paramInfos[i].name)))
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+long paramGet(unsigned char index)
+{
+	paramInfo info;
+	long value = 0;
+	const unsigned char *p;
+	unsigned char size, sreg = SREG;
+
+	if(index >= PARAM_COUNT)
+	{
+		return 0;
+	}
+	memcpy_P(&info, &paramInfos[index], sizeof(info));
+	size = info.size & ~PARAM_SIGNED;
+	p = (const unsigned char *)&param + info.offset;
+
+	cli();
+	memcpy(&value, p, size);		// LSB d'abord, comme long
+	SREG = sreg;
+	if((info.size & PARAM_SIGNED) && size < 4 && (p[size - 1] & 0x80))
+	{
+		value -= 1L << (8*size);		// extension du signe
+	}
+	return value;
+}
+
+unsigned char paramSet(unsigned char index, long value)
+{
+	paramInfo info;
+	unsigned char size, sreg = SREG;
+
+	if(index >= PARAM_COUNT)
+	{
+		return 0;
+	}
+	memcpy_P(&info, &paramInfos[index], sizeof(info));
+	size = info.size & ~PARAM_SIGNED;
+
+	if(size < 4)
+	{
+		if(info.size & PARAM_SIGNED)
+		{
+			if(value < -(1L << (8*size - 1)) || value >= (1L << (8*size - 1)))
+			{
+				return 0;
+			}
+		}
+		else if(value < 0 || value >= (1L << (8*size)))
+		{
+			return 0;
+		}
+	}
+
+	cli();
+	memcpy((unsigned char *)&param + info.offset, &value, size);
+	SREG = sreg;
+	return 1;
+}
+
+static void paramPrint(unsigned char index)
+{
+	char text[12];
+
+	uartSendString_P((PGM_P)pgm_read_word(&paramInfos[index].name));
+	uartSendByte('=');
+	uartSendString(ltoa(paramGet(index), text, 10));
+	uartSendByte('\n');
+}
+
+// Mot suivant de la ligne, terminé par un byte nul
+static char *paramWord(char **line)
+{
+	char *word;
+
+	while(**line == ' ')
+	{
+		(*line)++;
+	}
+	word = *line;
+	while(**line && **line != ' ')
+	{
+		(*line)++;
+	}
+	if(**line)
+	{
+		*(*line)++ = 0;
+	}
+	return word;
+}
+
+static void paramCommand(char *line)
+{
+	char *command = paramWord(&line);
+	char *name = paramWord(&line);
+	char *arg = paramWord(&line);
+	char *end;
+	signed char index = paramFind(name);
+	unsigned char i;
+	long value;
+
+	if(!strcmp_P(command, PSTR("list")))
+	{
+		for(i = 0; i < PARAM_COUNT; i++)
+		{
+			paramPrint(i);
+		}
+		return;
+	}
+	if(!strcmp_P(command, PSTR("save")))
+	{
+		uartSendString_P(paramSave() ? PSTR("ok\n") : PSTR("busy\n"));
+		return;
+	}
+	if(!strcmp_P(command, PSTR("defaults")))
+	{
+		paramDefaults();
+		uartSendString_P(PSTR("ok\n"));
+		return;
+	}
+	if(index >= 0 && !strcmp_P(command, PSTR("get")))
+	{
+		paramPrint(index);
+		return;
+	}
+	if(index >= 0 && !strcmp_P(command, PSTR("set")))
+	{
+		value = strtol(arg, &end, 0);
+		if(*arg && !*end && paramSet(index, value))
+		{
+			paramPrint(index);
+			return;
+		}
+	}
+	uartSendString_P(PSTR("?\n"));
+}
+
+void paramPoll(void)
+{
+	unsigned char c;
+
+	while(uartRead(&c, 1))
+	{
+		if(c == '\r' || c == '\n')
+		{
+			if(paramLength == PARAM_LINE)
+			{
+				uartSendString_P(PSTR("?\n"));
+			}
+			else if(paramLength)
+			{
+				paramLine[paramLength] = 0;
+				paramCommand(paramLine);
+			}
+			paramLength = 0;
+		}
+		else if(paramLength < PARAM_LINE - 1)
+		{
+			paramLine[paramLength++] = c;
+		}
+		else
+		{
+			paramLength = PARAM_LINE;
+		}
+	}
+}
@@ -0,0 +1,103 @@
+#ifndef __param_h
+#define __param_h
+/***************************************************************************************
+ *
+ * Paramètres réglables en EEPROM
+ * Fichier: param.h
+ *
+ ***************************************************************************************/
+
+/** \defgroup param_h Paramètres
+
+	\brief	Gains, temps d'exposition, trims... gardés en EEPROM et modifiables par l'UART sans recompiler
+
+	Les paramètres sont déclarés dans paramdef.h (PARAM(nom, type, défaut), types entiers seulement)
+	et lus par le programme dans le cache en RAM: param.motorKp, param.lcamExposure...
+	paramInit() charge le dernier enregistrement valide de l'EEPROM, ou les valeurs par défaut.
+
+	paramSave() copie le cache et rend la main tout de suite: les bytes sont écrits un par un par
+	l'interruption EE_RDY (~8.5ms chacun, les bytes inchangés ne sont pas réécrits). Chaque sauvegarde
+	va dans l'enregistrement suivant d'une zone tournante de PARAM_EEPROM_SIZE bytes, avec un numéro et
+	un CRC: une coupure pendant l'écriture laisse l'enregistrement précédent valide, et l'usure est
+	répartie sur tous les enregistrements.
+
+	paramPoll(), appelée par la boucle principale, lit des commandes d'une ligne sur l'UART:
+	\code
+	list					tous les paramètres, "nom=valeur" par ligne
+	get motorKp
+	set motorKp 300
+	save					écrit le cache en EEPROM, en arrière-plan
+	defaults				revient aux valeurs par défaut (sans sauver)
+	\endcode
+
+	Les commandes consomment tout ce qui arrive sur l'UART. Le cache est modifié par paramPoll, dans la boucle
+	principale: les valeurs doivent être relues par le programme (ex: motorPI(0, param.motorKp, param.motorKi)).
+	"make writeflash" efface l'EEPROM (avrdude -e) sauf si le fusible EESAVE est programmé.
+
+*/
+/*@{*/
+
+#ifndef PARAM_EEPROM_SIZE
+#define PARAM_EEPROM_SIZE	256		// EEPROM utilisée par les enregistrements tournants
+#endif
+#ifndef PARAM_VERSION
+#define PARAM_VERSION		1		// A changer quand paramdef.h change: les anciens enregistrements sont ignorés
+#endif
+#ifndef PARAM_LINE
+#define PARAM_LINE			24		// Longueur maximale d'une commande
+#endif
+
+/** \brief Valeurs de tous les paramètres */
+typedef struct
+{
+#define PARAM(name, type, value)	type name;
+#include "paramdef.h"
+#undef PARAM
+} paramValues;
+
+/** \brief Numéro de chaque paramètre (PARAM_motorKp...) */
+enum
+{
+#define PARAM(name, type, value)	PARAM_##name,
+#include "paramdef.h"
+#undef PARAM
+	PARAM_COUNT
+};
+
+/** \brief Cache en RAM, lu et modifié directement par le programme */
+extern paramValues param;
+
+/** \brief Charge le dernier enregistrement valide (retourne 1), sinon les valeurs par défaut (retourne 0) */
+unsigned char paramInit(void);
+
+/** \brief Remet les valeurs par défaut dans le cache */
+void paramDefaults(void);
+
+/** \brief Lance l'écriture du cache en EEPROM
+
+	\return 1 si l'écriture est lancée, 0 si la précédente n'est pas terminée
+
+*/
+unsigned char paramSave(void);
+
+/** \brief Retourne 1 tant qu'une écriture est en cours */
+unsigned char paramBusy(void);
+
+/** \brief Numéro du paramètre de ce nom, -1 s'il n'existe pas */
+signed char paramFind(const char *name);
+
+/** \brief Valeur d'un paramètre par son numéro (0 si le numéro n'existe pas) */
+long paramGet(unsigned char index);
+
+/** \brief Modifie un paramètre par son numéro
+
+	\return 1 si la valeur a été écrite, 0 si le numéro n'existe pas ou si la valeur ne tient pas dans le type
+
+*/
+unsigned char paramSet(unsigned char index, long value);
+
+/** \brief Lit et exécute les commandes reçues sur l'UART, sans attendre */
+void paramPoll(void);
+
+/*@}*/
+#endif
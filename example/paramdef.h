@@ -0,0 +1,13 @@
+//**************************************************************//
+//* Paramètres réglables du programme (voir param.h)           //
+//* PARAM(nom, type entier, valeur par défaut)                 //
+//* Inclus plusieurs fois par param.h: pas de garde d'inclusion //
+//**************************************************************//
+
+PARAM(motorKp,			int,			256)	// motorPI, 1/256
+PARAM(motorKi,			int,			32)
+PARAM(lcamExposure,		unsigned int,	400)	// us
+PARAM(lcamContrast,		unsigned char,	11)		// contraste minimal d'un pic
+PARAM(servoTrim0,		signed char,	0)		// décalage des servos 0 et 1
+PARAM(servoTrim1,		signed char,	0)
+PARAM(bumperDebounce,	unsigned int,	5000)	// us
@@ -146,14 +146,20 @@ The protocol is as follows:
 
 import sys
 import os
+import errno
 import termios
 import select
 import time
 import array
+import binascii
+import hashlib
+import glob
+import copy
+import threading
 from optparse import OptionParser
 
 VERSION_MAJOR=1
-VERSION_MINOR=1
+VERSION_MINOR=3
 
 _usage="""\
 %prog [Options] prog.hex
@@ -164,11 +170,26 @@ The optional reset string (--send-reset parameter) can include C-style control
 characters such as \\n and \\r. For example:
 
     pygaload.py --send-reset='reset\\r\\n' ...
-    pygaload.py --send-reset='\\x03' ...  """
+    pygaload.py --send-reset='\\x03' ...
+
+The image last written to each board is cached (see --cache-dir), and only the
+pages that differ from it are sent. Boards are told apart by the serial number
+of their USB serial adapter, not by the port name (/dev/ttyUSB* are renumbered
+when boards are replugged); without a serial number every page is sent. Use
+--full after programming the device with another tool (e.g. avrdude), since the
+cache cannot know about it ('make writeflash' clears the cache).
+
+Several boards can be programmed at once with the same HEX file by repeating
+--port or giving a pattern, each port is handled by its own thread:
+
+    pygaload.py -p /dev/ttyUSB0 -p /dev/ttyUSB1 prog.hex
+    pygaload.py -p '/dev/ttyUSB*' --retries 2 prog.hex"""
 
 Default_DevicePort = "/dev/ttyUSB0"
 Default_BaudRate   = 38400
 Default_Timeout    = 10
+Default_CacheDir   = os.path.join(os.path.expanduser('~'), '.pygaload')
+Default_Retries    = 0
 
 ##############################################################################
 
@@ -368,7 +389,7 @@ def doConnect(options):
 
   tic = time.time()
   while (time.time()-tic) < options.Timeout:
-    L = poll.poll(1000)
+    L = options.poll.poll(1000)
     if L:
       c = ord(os.read(options.dev,1))
 
@@ -466,47 +487,20 @@ def doConnect(options):
 
   return None
 
-def downloadFlash(options, proc, datalines):
-  # Basic checks:
-  #   - make sure we're not going beyond max address where bootloader starts
-  #   - make sure flash is an integer number of pages
-  #   - make sure boot section is an integer number of pages
-
-  lastAddr = datalines[-1][0]
-  lastAddr += len(datalines[-1][1])
-
-  if lastAddr > (proc.flash - proc.boot):
-    print '*** HEX file contents extends into bootloader'
-    return 0
-
-  NumPages = proc.flash // proc.page
-  if NumPages*proc.page != proc.flash:
-    print '*** FLASH size is not an integer number of pages'
-    return 0
-
-  NumPages -= proc.boot // proc.page
-  if NumPages*proc.page + proc.boot != proc.flash:
-    print '*** Bootloader size is not an integer number of pages'
-    return 0
-
+def buildPages(proc, datalines, NumPages):
+  """Returns a dictionary pagenum -> page contents (string) of the non-empty pages"""
   emptypage = '\xFF'*proc.page
+  pages = {}
 
   datalinesix = 0
   addr = datalines[datalinesix][0]
   data = datalines[datalinesix][1]
   addrix = 0
 
-  if options.Debug:
-    dumpfid = file('dump.txt','wt')
-
   for pagenum in range(NumPages):
     startAddr = pagenum*proc.page
     endAddr = startAddr + proc.page
 
-    if options.Verbose:
-      print '\r    Page %d ...' % pagenum,
-      sys.stdout.flush()
-
     if addr >= endAddr:
       # Next byte to write is past this page
       continue
@@ -532,80 +526,336 @@ def downloadFlash(options, proc, datalines):
         break
 
     towrite = page.tostring()
-
     if towrite != emptypage:
-      for tries in range(3):
-        if options.Debug:
-          print >> dumpfid, 'Page:', pagenum
-          for ix in range(len(towrite)):
-            print >> dumpfid, '%02X ' % ord(towrite[ix]),
-            if (ix & 0x0F) == 0x0F:
-              print >> dumpfid
-        else:
-          #print 'Writing length-%d string' % len(towrite)
-          os.write(options.dev, chr((pagenum >> 8) & 0xFF))
-          os.write(options.dev, chr(pagenum & 0xFF))
-          #for ix in range(len(towrite)):
-          #  os.write(options.dev, towrite[ix])
-          os.write(options.dev, towrite)
-
-        checksum = 0
+      pages[pagenum] = towrite
+
+  return pages
+
+def deviceIdentity(port):
+  """Stable name of the USB serial adapter behind port (vendor, product, serial
+  number and interface, from sysfs), None if it has no serial number: adapters
+  of the same model would then look identical"""
+  tty = os.path.basename(os.path.realpath(port))
+  path = os.path.realpath(os.path.join('/sys/class/tty', tty, 'device'))
+  interface = ''
+  while path != os.sep:
+    try:
+      if not interface and os.path.isfile(os.path.join(path, 'bInterfaceNumber')):
+        interface = file(os.path.join(path, 'bInterfaceNumber')).read().strip()
+      if os.path.isfile(os.path.join(path, 'idVendor')):
+        ident = [file(os.path.join(path, name)).read().strip() for name in ('idVendor', 'idProduct', 'serial')]
+        ident.append(interface)
+        return '-'.join([''.join([c if c.isalnum() else '_' for c in item]) for item in ident])
+    except IOError:
+      return None
+    path = os.path.dirname(path)
+  return None
+
+def cacheFile(options, proc, identity):
+  # One cache per adapter and processor: 0403-6001-A600XYZ-00-ATmega8535.cache
+  return os.path.join(options.CacheDir, '%s-%s.cache' % (identity, proc.proc))
+
+def imageHash(pages):
+  h = hashlib.sha1()
+  for pagenum in sorted(pages.keys()):
+    h.update('%d:%s;' % (pagenum, pages[pagenum]))
+  return h.hexdigest()
+
+def readCache(options, proc, identity):
+  """Returns the dictionary pagenum -> contents last written to this device, empty if unknown.
+  The cache is only trusted if the hash of its pages matches the one recorded after a
+  complete download."""
+  pages = {}
+  try:
+    fid = file(cacheFile(options, proc, identity), 'rt')
+    if fid.readline().split() != ['page', str(proc.page)]:
+      return {}
+    image = fid.readline().split()
+    if len(image) != 2 or image[0] != 'image':
+      return {}
+    for line in fid:
+      pagenum, contents = line.split()
+      pages[int(pagenum)] = binascii.unhexlify(contents)
+    fid.close()
+  except (IOError, ValueError, TypeError):
+    return {}
+  if imageHash(pages) != image[1]:
+    return {}
+  return pages
+
+def writeCache(options, proc, identity, pages, complete):
+  """Records the pages on the device; after a failed download the image is marked
+  unknown so that the next one sends every page"""
+  filename = cacheFile(options, proc, identity)
+  try:
+    try:
+      os.makedirs(options.CacheDir)
+    except OSError:
+      if not os.path.isdir(options.CacheDir):
+        raise
+    fid = file(filename + '.tmp', 'wt')
+    print >> fid, 'page', proc.page
+    print >> fid, 'image', complete and imageHash(pages) or 'unknown'
+    for pagenum in sorted(pages.keys()):
+      print >> fid, pagenum, binascii.hexlify(pages[pagenum])
+    fid.close()
+    os.rename(filename + '.tmp', filename)
+  except (IOError, OSError), detail:
+    print '*** Unable to write cache %s:\n  %s' % (filename, str(detail))
+
+def writeAll(options, s):
+  # The device is opened with O_NDELAY: a write may be partial when the tty buffer is full
+  while s:
+    try:
+      n = os.write(options.dev, s)
+    except OSError, detail:
+      if detail.errno != errno.EAGAIN:
+        raise
+      n = 0
+    s = s[n:]
+    if s:
+      select.select([], [options.dev], [], 1.0)
+
+def downloadFlash(options, proc, datalines):
+  # Basic checks:
+  #   - make sure we're not going beyond max address where bootloader starts
+  #   - make sure flash is an integer number of pages
+  #   - make sure boot section is an integer number of pages
+
+  lastAddr = datalines[-1][0]
+  lastAddr += len(datalines[-1][1])
+
+  if lastAddr > (proc.flash - proc.boot):
+    print '*** HEX file contents extends into bootloader'
+    return 0
+
+  NumPages = proc.flash // proc.page
+  if NumPages*proc.page != proc.flash:
+    print '*** FLASH size is not an integer number of pages'
+    return 0
+
+  NumPages -= proc.boot // proc.page
+  if NumPages*proc.page + proc.boot != proc.flash:
+    print '*** Bootloader size is not an integer number of pages'
+    return 0
+
+  pages = buildPages(proc, datalines, NumPages)
+
+  # Pages are written one by one by the bootloader (no chip erase), so a page
+  # identical to the one in the cache is already on the device.
+  identity = None
+  if not options.Debug:
+    identity = deviceIdentity(options.DevicePort)
+    if identity is None and (options.Verbose or options.Multi):
+      print 'No USB serial number for %s, sending every page' % options.DevicePort
+  if identity is None:
+    cache = {}
+  else:
+    cache = readCache(options, proc, identity)
+  if options.Full or identity is None:
+    sent = pages.keys()
+  else:
+    sent = [pagenum for pagenum in pages.keys() if cache.get(pagenum) != pages[pagenum]]
+  sent.sort()
+  report(options, '%d pages to send, %d unchanged' % (len(sent), len(pages) - len(sent)))
+
+  if options.Debug:
+    dumpfid = file('dump.txt','wt')
+
+  tic = time.time()
+  wirebytes = 0
+  result = 1
+
+  for count, pagenum in enumerate(sent):
+    towrite = pages[pagenum]
+
+    if options.Verbose and not options.Multi:
+      print '\r    Page %d ...' % pagenum,
+      sys.stdout.flush()
+    elif count and (count*4) // len(sent) != ((count-1)*4) // len(sent):
+      report(options, '%d%%' % (count*100 // len(sent)))
+
+    checksum = sum(array.array('B', towrite)) & 0xFF
+
+    # Page number, data and checksum in a single write
+    packet = chr((pagenum >> 8) & 0xFF) + chr(pagenum & 0xFF) + towrite + chr(checksum)
+
+    for tries in range(3):
+      if options.Debug:
+        print >> dumpfid, 'Page:', pagenum
         for ix in range(len(towrite)):
-          checksum += ord(towrite[ix])
+          print >> dumpfid, '%02X ' % ord(towrite[ix]),
+          if (ix & 0x0F) == 0x0F:
+            print >> dumpfid
+        print >> dumpfid, "Checksum:", hex(checksum)
+        c = ord('!')
+      else:
+        writeAll(options, packet)
+        wirebytes += len(packet)
 
-        if options.Debug:
-          print >> dumpfid, "Checksum:", hex(checksum & 0xFF)
-        else:
-          #print 'Writing checksum:', chr(checksum & 0xFF)
-          os.write(options.dev, chr(checksum & 0xFF))
-
-        if options.Debug:
-          if 0:
-            print 'Response to page #%d' % pagenum, '(! or @ or Enter):'
-            s = raw_input()
-            if s:
-              c = ord(s[0])
-            else:
-              c = None
-          else:
-            c = ord('!')
+        L = options.poll.poll(3000)
+        if L:
+          c = ord(os.read(options.dev,1))
         else:
-          L = options.poll.poll(3000)
-          if L:
-            c = ord(os.read(options.dev,1))
-          else:
-            c = None
-
-        if c is not None:
-          if c == 0x21:
-            break   # successful write
-          elif c == 0x40:
-            if options.Verbose:
-              print 'failed'
-              print '\r    Page %d ...' % pagenum,
-              sys.stdout.flush()
-          else:
-            print '\n*** Unexpected response %02X to FLASH page write' % c
-            return 0
+          c = None
+
+      if c is not None:
+        if c == 0x21:
+          cache[pagenum] = towrite
+          break   # successful write
+        elif c == 0x40:
+          if options.Verbose:
+            print 'failed'
+            print '\r    Page %d ...' % pagenum,
+            sys.stdout.flush()
         else:
-          print '\n*** No response from bootloader'
-          return 0
+          print '\n*** Unexpected response %02X to FLASH page write' % c
+          result = 0
+          break
       else:
-        print '\n*** Giving up after 3 tries'
-        return 0
+        print '\n*** No response from bootloader'
+        result = 0
+        break
+    else:
+      print '\n*** Giving up after 3 tries'
+      result = 0
+
+    if not result:
+      # The contents of this page on the device are unknown now
+      if cache.has_key(pagenum):
+        del cache[pagenum]
+      break
+
+  if identity is not None:
+    writeCache(options, proc, identity, cache, result)
+
+  if not result:
+    return 0
 
   # Flash writing is all done...we must send a page number of 0xFFFF
-  os.write(options.dev, '\xFF\xFF')
+  if not options.Debug:
+    writeAll(options, '\xFF\xFF')
 
-  if options.Verbose:
+  if options.Verbose and not options.Multi:
     print
+
+  elapsed = max(time.time() - tic, 1e-3)
+  options.Summary = '%d pages sent, %d unchanged, %.1f s' % (len(sent), len(pages) - len(sent), elapsed)
+
+  if options.Stats:
+    print '    Pages: %d sent, %d unchanged, %d empty' % \
+          (len(sent), len(pages) - len(sent), NumPages - len(pages))
+    print '    Bytes: %d sent for a %d-byte image in %.2f s' % \
+          (wirebytes, len(pages)*proc.page, elapsed)
+    print '    Speed: %.0f bytes/s on the wire, %.0f image bytes/s effective' % \
+          (wirebytes / elapsed, len(pages)*proc.page / elapsed)
+
   return 1
 
+class PortOutput:
+  """Replaces sys.stdout while several ports are programmed: every line
+  printed by a download thread is prefixed with its port, and lines from
+  different threads are not mixed."""
+  def __init__(self, out):
+    self.out = out
+    self.lock = threading.Lock()
+    self.local = threading.local()
+
+  def setPort(self, port):
+    self.local.prefix = '%s: ' % port
+    self.local.line = ''
+
+  def write(self, s):
+    lines = (getattr(self.local, 'line', '') + s.replace('\r', '')).split('\n')
+    self.local.line = lines.pop()
+    prefix = getattr(self.local, 'prefix', '')
+    self.lock.acquire()
+    try:
+      for line in lines:
+        if line.strip():
+          self.out.write(prefix + line.strip() + '\n')
+      self.out.flush()
+    finally:
+      self.lock.release()
+
+  def flush(self):
+    pass
+
+def report(options, text):
+  # Progress lines, only when several ports are programmed (see PortOutput)
+  if options.Multi:
+    print text
+
+def expandPorts(patterns):
+  """Ports from the --port options: comma-separated lists and glob patterns"""
+  ports = []
+  for pattern in patterns:
+    for item in pattern.split(','):
+      if glob.has_magic(item):
+        matches = sorted(glob.glob(item))
+        if not matches:
+          print '*** No device matches %s' % item
+      else:
+        matches = [item]
+      for port in matches:
+        if port not in ports:
+          ports.append(port)
+  return ports
+
+def flashPort(options, datalines):
+  """Connects to the bootloader on options.DevicePort and downloads the FLASH"""
+  dev = openDevice(options)
+  options.dev = dev
+
+  try:
+    poll = select.poll()
+    poll.register(dev, select.POLLIN|select.POLLPRI)
+    options.poll = poll
+
+    if options.SendReset is not None:
+      if options.Verbose:
+        sys.stdout.write('Sending reset string ...\n')
+      exec('s="%s"' % options.SendReset)
+      writeAll(options, s)
+
+    if options.Verbose:
+      sys.stdout.write('Waiting for bootloader to connect ...')
+      sys.stdout.flush()
+
+    proc = doConnect(options)
+    if not proc:
+      report(options, '*** No answer from bootloader')
+      return 0
+    report(options, 'connected to %s (MegaLoad %d)' % (proc.proc, proc.loaderversion))
+
+    if options.Verbose:
+      print 'Downloading FLASH ...'
+    return downloadFlash(options, proc, datalines)
+  finally:
+    os.close(dev)
+
+def flashWithRetries(options, datalines):
+  if options.Multi:
+    sys.stdout.setPort(options.DevicePort)
+
+  options.Success = 0
+  for attempt in range(options.Retries + 1):
+    if attempt:
+      print 'Retrying (%d/%d) ...' % (attempt, options.Retries)
+    try:
+      if flashPort(options, datalines):
+        options.Success = 1
+        return
+    except SystemExit:
+      pass    # The error has already been printed
+    except Exception, detail:
+      print '*** %s' % str(detail)
+
 if __name__ == "__main__":
   parser = OptionParser(usage=_usage)
-  parser.add_option("-p", "--port", dest="DevicePort", \
-                    help="Device port for communication (default: %s)" % Default_DevicePort, \
-                    metavar="DEV", default=Default_DevicePort)
+  parser.add_option("-p", "--port", dest="DevicePorts", action="append", \
+                    help="Device port for communication (default: %s), can be repeated or be a pattern such as '/dev/ttyUSB*'" % Default_DevicePort, \
+                    metavar="DEV", default=None)
   parser.add_option("-b", "--baud-rate", type="int", dest="BaudRate", help="Baud rate (default: %d)" % Default_BaudRate, \
                     metavar="BAUD", default=Default_BaudRate)
   parser.add_option("-V", "--verbose", dest="Verbose", action="store_true", default=False, help="Print verbose progress reports")
@@ -615,6 +865,14 @@ if __name__ == "__main__":
   parser.add_option("-s", "--send-reset", dest="SendReset", metavar="STRING", default=None, \
                     help="String to send to invoke bootloader")
   parser.add_option("-v", "--version", dest="Version", action="store_true", default=False, help="Print version info and exit")
+  parser.add_option("-f", "--full", dest="Full", action="store_true", default=False, \
+                    help="Send every non-empty page, even if the cache says it is unchanged")
+  parser.add_option("--cache-dir", dest="CacheDir", metavar="DIR", default=Default_CacheDir, \
+                    help="Where the last image written to each device is kept (default: %s)" % Default_CacheDir)
+  parser.add_option("--stats", dest="Stats", action="store_true", default=False, \
+                    help="Print pages sent/skipped and transfer speed")
+  parser.add_option("-r", "--retries", dest="Retries", type="int", default=Default_Retries, metavar="N", \
+                    help="Start over (reset string, connection, download) up to N times on failure (default: %d)" % Default_Retries)
       
   (options, args) = parser.parse_args()
   if options.Version:
@@ -640,44 +898,60 @@ Grand Valley State University
     print '*** HEX file is empty...nothing to download'
     sys.exit(1)
 
-  if not options.Debug:
-    dev = openDevice(options)
-    options.dev = dev
-  
-    poll = select.poll()
-    poll.register(dev, select.POLLIN|select.POLLPRI)
-    options.poll = poll
-
-    if options.SendReset is not None:
-      if options.Verbose:
-        sys.stdout.write('Sending reset string ...\n')
-      exec('s="%s"' % options.SendReset)
-      os.write(options.dev, s)
-
-    if options.Verbose:
-      sys.stdout.write('Waiting for bootloader to connect ...')
-      sys.stdout.flush()
+  ports = expandPorts(options.DevicePorts or [Default_DevicePort])
+  if not ports:
+    sys.exit(1)
+  options.Multi = len(ports) > 1
+  options.DevicePort = ports[0]
 
-    proc = doConnect(options)
-  else:
+  if options.Debug:
     proc = Proc()
     proc.proc = 'ATmega32'
     proc.flash = 32768
     proc.boot = 512*2
     proc.page = 128
     proc.eeprom = 1024
+    options.Multi = False
 
-  if proc:
-    if options.Verbose:
-      print 'Downloading FLASH ...'
-  else:
+    if downloadFlash(options, proc, datalines):
+      print 'Downloading successful'
+      sys.exit(0)
     print '*** Downloading failed'
     sys.exit(1)
 
-  if downloadFlash(options, proc, datalines):
-    print 'Downloading successful'
-  else:
+  if not options.Multi:
+    flashWithRetries(options, datalines)
+    if options.Success:
+      print 'Downloading successful'
+      sys.exit(0)
     print '*** Downloading failed'
     sys.exit(1)
 
-  sys.exit(0)
+  # One thread per board, the HEX file is parsed only once
+  boards = []
+  sys.stdout = PortOutput(sys.stdout)
+  for port in ports:
+    board = copy.copy(options)
+    board.DevicePort = port
+    board.Summary = ''
+    thread = threading.Thread(target=flashWithRetries, args=(board, datalines))
+    thread.setDaemon(True)
+    thread.start()
+    boards.append((board, thread))
+
+  for board, thread in boards:
+    while thread.isAlive():
+      thread.join(0.5)    # join() without timeout would block Ctrl-C
+  sys.stdout = sys.stdout.out
+
+  print
+  failed = 0
+  for board, thread in boards:
+    if board.Success:
+      print '  %-20s ok      %s' % (board.DevicePort, board.Summary)
+    else:
+      print '  %-20s FAILED' % board.DevicePort
+      failed += 1
+  print '%d of %d boards programmed' % (len(boards) - failed, len(boards))
+
+  sys.exit(failed and 1 or 0)
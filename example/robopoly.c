@@ -13,107 +13,284 @@
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/sleep.h>
 #include <util/delay_basic.h>
 #include "robopoly.h"
 #include <util/setbaud.h>
 
 
-void digitalWrite(unsigned char port, unsigned char bit, unsigned char value)
+volatile unsigned char isrWakeCount = 0;
+
+#ifdef ISR_STATS
+#ifdef notimer
+#error "-D ISR_STATS utilise le timer 0 comme chronomètre"
+#endif
+#include <stdlib.h>
+
+static isrStat isrStats[ISR_STATS_COUNT];
+static volatile unsigned long time;		// ticks du timer 0, défini avec la base de temps
+
+// Temps en pas de 8us sur 16 bits (déborde après 524ms), interruptions désactivées:
+// compte aussi un débordement du timer 0 pas encore traité
+static inline unsigned int isrStatsNow(void)
 {
-	
-	if(bit == 0xFF)
+	unsigned char t = TCNT0;
+	unsigned int ticks = (unsigned int)time;
+
+	if((TIFR & (1<<TOV0)) && t < 128)
 	{
-		switch(port)
-		{
-		case 'A':
-			DDRA = 0xFF;
-			PORTA = value;
-			return;
-		case 'B':
-			DDRB = 0xFF;
-			PORTB = value;
-			return;
-		case 'C':
-			DDRC = 0xFF;
-			PORTC = value;
-			return;
-		case 'D':
-			DDRD = 0xFF;
-			PORTD = value;
-			return;
-		}
+		ticks++;
 	}
-	else
+	return (ticks << 8) | t;
+}
+
+static inline void isrStatsRecord(unsigned char vector, unsigned int entry, unsigned int latency, unsigned char overrun)
+{
+	isrStat *stat = &isrStats[vector];
+	unsigned int duration = isrStatsNow() - entry;
+
+	stat->count++;
+	stat->durationTotal += duration;
+	if(duration > stat->durationMax)
 	{
-		value = value << bit;
-		switch(port)
-		{
-		case 'A':
-			DDRA |= (1<<bit);
-			PORTA = (PORTA & (~(1<<bit))) + value;
-			return;
-		case 'B':
-			DDRB |= (1<<bit);
-			PORTB = (PORTB & (~(1<<bit))) + value;
-			return;
-		case 'C':
-			DDRC |= (1<<bit);
-			PORTC = (PORTC & (~(1<<bit))) + value;
-			return;
-		case 'D':
-			DDRD |= (1<<bit);
-			PORTD = (PORTD & (~(1<<bit))) + value;
-			return;
-		}
+		stat->durationMax = duration;
+	}
+	if(latency > stat->latencyMax)
+	{
+		stat->latencyMax = latency;
+	}
+	if(overrun && stat->overruns < 255)
+	{
+		stat->overruns++;
 	}
 }
 
+// A placer au début et à la fin de chaque interruption (latency et durées en pas de 8us).
+// cli: l'agenda réactive les interruptions et le timer 0 peut s'interrompre lui-même.
+// Versions inline pour les interruptions de ce fichier (celles de robopoly.h appellent une fonction,
+// ce qui fait sauvegarder tous les registres à l'entrée et allongerait les durées mesurées).
+#undef ISR_STATS_BEGIN
+#undef ISR_STATS_END
+#define ISR_STATS_BEGIN(latency)		unsigned int isrEntry = isrStatsNow(); unsigned int isrLatency = (latency);
+#define ISR_STATS_END(vector, overrun)	cli(); isrStatsRecord((vector), isrEntry, isrLatency, (overrun));
+// Dans TIMER0_OVF, après time++: l'entrée a été lue avant que le débordement traité soit compté
+#define ISR_STATS_REBASE()				isrEntry += 256;
+#else
+#define ISR_STATS_REBASE()
+#endif
+
 
-unsigned char digitalRead (unsigned char port, unsigned char bit)
+// Versions non inline de digitalWrite/digitalRead, utilisées quand le port ou la ligne sont variables.
+// Les lecture-modification-écriture sont faites interruptions désactivées.
+void digitalWriteRuntime(unsigned char port, unsigned char bit, unsigned char value)
 {
-	if(bit == 0xFF)
+	if(port < 'A' || port > 'D')
 	{
-		switch(port)
-		{
-		case 'A':
-			DDRA = 0;
-			return PINA;
-		case 'B':
-			DDRB = 0;
-			return PINB;
-		case 'C':
-			DDRC = 0;
-			return PINC;
-		case 'D':
-			DDRD = 0;
-			return PIND;
-		}
+		return;
 	}
-	else
+
+	if(bit == BYTE)
 	{
-		switch(port)
-		{
-			case 'A':
-				DDRA &= ~(1<<bit);
-				return (PINA >> bit) & 1;
-			case 'B':
-				DDRA &= ~(1<<bit);
-				return (PINB >> bit) & 1;
-			case 'C':
-				DDRA &= ~(1<<bit);
-				return (PINC >> bit) & 1;
-			case 'D':
-				DDRA &= ~(1<<bit);
-				return (PIND >> bit) & 1;
-		}
+		*GPIO_DDR(port) = 0xFF;
+		*GPIO_PORT(port) = value;
+	}
+	else if(bit < 8)
+	{
+		digitalWriteMaskRuntime(port, 1<<bit, value ? 0xFF : 0);
+	}
+}
+
+
+unsigned char digitalReadRuntime(unsigned char port, unsigned char bit)
+{
+	unsigned char sreg;
+
+	if(port < 'A' || port > 'D')
+	{
+		return 0;
+	}
+
+	if(bit == BYTE)
+	{
+		*GPIO_DDR(port) = 0;
+		return *GPIO_PIN(port);
+	}
+	if(bit < 8)
+	{
+		sreg = SREG;
+		cli();
+		*GPIO_DDR(port) &= ~(1<<bit);
+		SREG = sreg;
+		return (*GPIO_PIN(port) >> bit) & 1;
 	}
 	return 0;
 }
 
 
+void digitalWriteMaskRuntime(unsigned char port, unsigned char mask, unsigned char value)
+{
+	volatile unsigned char *reg;
+	unsigned char sreg;
+
+	if(port < 'A' || port > 'D')
+	{
+		return;
+	}
+
+	reg = GPIO_PORT(port);
+	sreg = SREG;
+	cli();
+	*(reg - 1) |= mask;
+	*reg = (*reg & ~mask) | (value & mask);
+	SREG = sreg;
+}
+
+
+#ifndef noadc
+
+#if (ADC_OVERSAMPLE & (ADC_OVERSAMPLE - 1)) || (ADC_OVERSAMPLE > 64)
+#error "ADC_OVERSAMPLE doit etre une puissance de deux (max 64)"
+#endif
+
+#define ADC_PRESCALER	6		// fclk/64 = 125kHz, ~104us par conversion
+#if ADC_BITS == 10
+#define ADC_ADMUX(ch)	(ch)				// référence AREF, résultat aligné à droite
+#else
+#define ADC_ADMUX(ch)	((1<<ADLAR) | (ch))	// seul ADCH est lu
+#endif
+
+// Deux tableaux de mesures: l'ISR remplit l'un pendant que l'autre est lu
+static volatile analog_t analogValues[2][8];
+static volatile unsigned char analogFront = 0;
+static volatile unsigned char analogSeq = 0;
+static volatile unsigned char analogChannels = 0;
+static unsigned char analogChannel;
+static unsigned int analogSum;
+static unsigned char analogSamples;
+
+void analogScanStart(unsigned char channels)
+{
+	unsigned char sreg, i;
+
+	if(channels == 0)
+	{
+		analogScanStop();
+		return;
+	}
+
+	sreg = SREG;
+	cli();
+	DDRA &= ~channels;
+	for(i=0; (channels & (1<<i)) == 0; i++);
+
+	analogChannels = channels;
+	analogChannel = i;
+	analogSum = 0;
+	analogSamples = 0;
+	ADMUX = ADC_ADMUX(i);
+	ADCSRA = (1<<ADEN)|(1<<ADSC)|(1<<ADIF)|(1<<ADIE)|ADC_PRESCALER;
+	SREG = sreg;
+	sei();
+}
+
+void analogScanStop(void)
+{
+	ADCSRA = 0;
+	analogChannels = 0;
+}
+
+analog_t analogGet(unsigned char channel)
+{
+	analog_t value;
+	unsigned char sreg = SREG;
+
+	cli();
+	value = analogValues[analogFront][channel & 7];
+	SREG = sreg;
+	return value;
+}
+
+unsigned char analogSequence(void)
+{
+	return analogSeq;
+}
+
+static inline void analogScanIsr(void)
+{
+	unsigned char ch = analogChannel;
+	unsigned char next;
+
+	#if ADC_BITS == 10
+	analogSum += ADCW;
+	#else
+	analogSum += ADCH;
+	#endif
+
+	if(++analogSamples < ADC_OVERSAMPLE)
+	{
+		ADCSRA |= (1<<ADSC);	// même ligne
+		return;
+	}
+
+	analogValues[analogFront ^ 1][ch] = analogSum / ADC_OVERSAMPLE;
+	analogSum = 0;
+	analogSamples = 0;
+
+	next = ch;
+	do
+	{
+		next = (next + 1) & 7;
+	}
+	while((analogChannels & (1<<next)) == 0);
+
+	if(next <= ch)
+	{
+		// balayage terminé: les nouvelles mesures deviennent visibles
+		analogFront ^= 1;
+		analogSeq++;
+	}
+
+	analogChannel = next;
+	ADMUX = ADC_ADMUX(next);
+	ADCSRA |= (1<<ADSC);
+}
+
+ISR(ADC_vect)
+{
+	ISR_STATS_BEGIN(0)
+	ISR_WAKE()
+	analogScanIsr();
+	ISR_STATS_END(ISR_STATS_ADC, 0)
+}
+
+#endif
+
+
+// Mesure bloquante sur 8 bits. Si le scanner tourne, la ligne lui est ajoutée et sa dernière mesure est retournée.
 unsigned char analogReadPortA(unsigned char bit)
 {
 	unsigned char result;
+
+	#ifndef noadc
+	unsigned char seq;
+
+	if(analogChannels)
+	{
+		if((analogChannels & (1<<bit)) == 0)
+		{
+			analogChannels |= (1<<bit);
+			DDRA &= ~(1<<bit);
+			seq = analogSeq;
+			while((unsigned char)(analogSeq - seq) < 2);	// attend un balayage complet avec la nouvelle ligne
+		}
+		#if ADC_BITS == 10
+		return analogGet(bit) >> 2;
+		#else
+		return analogGet(bit);
+		#endif
+	}
+	#endif
+
 	DDRA &= ~(1<<bit); 
 	ADCSRA = 0x87; 
 	ADMUX =0x20+bit; 
@@ -124,43 +301,258 @@ unsigned char analogReadPortA(unsigned char bit)
 	return result;
 }
 
+// Avec le timer 0, le processeur dort (mode idle) jusqu'à la dernière interruption avant l'échéance
+// puis attend activement: la durée ne dépend pas des interruptions. Interruptions désactivées,
+// ou avec -D notimer, c'est une simple boucle calibrée pour F_CPU.
 void waitms(unsigned int iter)
 {
+#ifndef notimer
+	unsigned long start, duration = iter * 1000UL;
+
+	if(SREG & (1<<SREG_I))
+	{
+		timerStart();
+		start = micros();
+		set_sleep_mode(SLEEP_MODE_IDLE);
+		while(micros() - start + 2048 < duration)
+		{
+			sleep_mode();		// réveillé au plus tard par le débordement du timer 0
+		}
+		while(micros() - start < duration);
+		return;
+	}
+#endif
 	for(;iter; iter--)
 	{
 		_delay_loop_2(2000);
 	}
 }
 
+// Attente active de iter microsecondes (8 cycles par microseconde, appel compris)
 void waitus(unsigned char iter)
 {
-	iter = iter >> 2;
-	for(; iter; iter--)
+	if(iter > 1)
 	{
-		_delay_loop_1(3);
+		_delay_loop_2((iter - 1) << 1);
 	}
 }
 
 
-// fonction bloquante tant que buffer d'envoi n'est pas prêt pour recevoir le nouveau byte
-static unsigned char uartStatus = 1;
-void uartSendByte(unsigned char a)
+#ifndef nouart
+
+#if (UART_TX_BUFFER_SIZE & (UART_TX_BUFFER_SIZE - 1)) || (UART_TX_BUFFER_SIZE > 256)
+#error "UART_TX_BUFFER_SIZE doit etre une puissance de deux (max 256)"
+#endif
+#if (UART_RX_BUFFER_SIZE & (UART_RX_BUFFER_SIZE - 1)) || (UART_RX_BUFFER_SIZE > 256)
+#error "UART_RX_BUFFER_SIZE doit etre une puissance de deux (max 256)"
+#endif
+
+#define UART_TX_MASK	(UART_TX_BUFFER_SIZE - 1)
+#define UART_RX_MASK	(UART_RX_BUFFER_SIZE - 1)
+
+// Buffers circulaires: head est avancé par le producteur, tail par le consommateur.
+// Une case reste toujours vide pour distinguer "plein" de "vide".
+static volatile unsigned char uartTxBuffer[UART_TX_BUFFER_SIZE];
+static volatile unsigned char uartRxBuffer[UART_RX_BUFFER_SIZE];
+static volatile unsigned char uartTxHead = 0;
+static volatile unsigned char uartTxTail = 0;
+static volatile unsigned char uartRxHead = 0;
+static volatile unsigned char uartRxTail = 0;
+
+volatile unsigned char uartRxOverflow = 0;
+volatile unsigned char uartTxOverflow = 0;
+
+void uartInit(void)
+{
+	UBRRH = UBRRH_VALUE;
+	UBRRL = UBRRL_VALUE;
+	#if USE_2X
+	UCSRA |= (1 << U2X);
+	#else
+	UCSRA &= ~(1 << U2X);
+	#endif
+	UCSRB = (1<<RXCIE)|(1<<RXEN)|(1<<TXEN);
+	sei();
+}
+
+// Envoie le prochain byte du buffer d'envoi (UDR doit être libre).
+// Retourne 1 quand le buffer vient de se vider à moitié ou complètement.
+static inline unsigned char uartTxNext(void)
 {
-	if(uartStatus)
+	unsigned char tail = uartTxTail;
+
+	if(tail != uartTxHead)
 	{
-		UBRRH = UBRRH_VALUE;
-		UBRRL = UBRRL_VALUE;
-		#if USE_2X
-		UCSRA |= (1 << U2X);
-		#else
-		UCSRA &= ~(1 << U2X);
-		#endif
-		UCSRB |= 0x18;
-		uartStatus = 0;
+		UDR = uartTxBuffer[tail];
+		tail = (tail + 1) & UART_TX_MASK;
+		uartTxTail = tail;
+		if(tail != uartTxHead)
+		{
+			return ((uartTxHead - tail) & UART_TX_MASK) == UART_TX_BUFFER_SIZE / 2;
+		}
+		UCSRB &= ~(1<<UDRIE);	// plus rien à envoyer
+		return 1;
+	}
+	UCSRB &= ~(1<<UDRIE);
+	return 0;
+}
+
+// Range le byte reçu dans le buffer de réception
+static inline void uartRxNext(void)
+{
+	unsigned char status = UCSRA;	// à lire avant UDR (DOR)
+	unsigned char data = UDR;
+	unsigned char next = (uartRxHead + 1) & UART_RX_MASK;
+
+	if(status & (1<<DOR))
+	{
+		uartRxOverflow++;
+	}
+	if(next == uartRxTail)
+	{
+		uartRxOverflow++;
+		return;
+	}
+	uartRxBuffer[uartRxHead] = data;
+	uartRxHead = next;
+}
+
+static void (*uartRefill)(void) = 0;
+static unsigned char uartRefilling = 0;
+
+ISR(USART_UDRE_vect)
+{
+	ISR_STATS_BEGIN(0)
+	ISR_WAKE()
+	if(uartTxNext() && uartRefill && !uartRefilling)
+	{
+		// Comme pour l'agenda, interruptions actives: les bytes ajoutés partent pendant le remplissage
+		// (l'interruption d'envoi imbriquée ne rappelle pas uartRefill).
+		uartRefilling = 1;
+		sei();
+		uartRefill();
+		cli();
+		uartRefilling = 0;
+	}
+	ISR_STATS_END(ISR_STATS_UART_UDRE, 0)
+}
+
+ISR(USART_RX_vect)
+{
+	ISR_STATS_BEGIN(0)
+	ISR_WAKE()
+	uartRxNext();
+	ISR_STATS_END(ISR_STATS_UART_RX, UCSRA & (1<<RXC))
+}
+
+// Ajoute un byte au buffer d'envoi, retourne 0 si le buffer est plein.
+// Protégé contre les interruptions pour pouvoir être appelé depuis une ISR.
+static unsigned char uartPut(unsigned char a)
+{
+	unsigned char sreg = SREG;
+	unsigned char next;
+
+	cli();
+	next = (uartTxHead + 1) & UART_TX_MASK;
+	if(next == uartTxTail)
+	{
+		SREG = sreg;
+		return 0;
+	}
+	uartTxBuffer[uartTxHead] = a;
+	uartTxHead = next;
+	UCSRB |= (1<<UDRIE);
+	SREG = sreg;
+	return 1;
+}
+
+// Non bloquante: copie au plus length bytes dans le buffer d'envoi et retourne
+// le nombre de bytes acceptés. Les bytes refusés sont comptés dans uartTxOverflow.
+unsigned char uartWrite(const unsigned char *data, unsigned char length)
+{
+	unsigned char i;
+
+	for(i=0; i<length; i++)
+	{
+		if(!uartPut(data[i]))
+		{
+			uartTxOverflow += length - i;
+			break;
+		}
+	}
+	return i;
+}
+
+// Non bloquante: copie au plus length bytes reçus dans data et retourne leur nombre
+unsigned char uartRead(unsigned char *data, unsigned char length)
+{
+	unsigned char i;
+	unsigned char tail = uartRxTail;
+
+	for(i=0; i<length && tail != uartRxHead; i++)
+	{
+		data[i] = uartRxBuffer[tail];
+		tail = (tail + 1) & UART_RX_MASK;
+	}
+	uartRxTail = tail;
+	return i;
+}
+
+// Nombre de bytes en attente dans le buffer de réception
+unsigned char uartAvailable(void)
+{
+	return (uartRxHead - uartRxTail) & UART_RX_MASK;
+}
+
+// Place libre dans le buffer d'envoi (une case reste toujours vide)
+unsigned char uartTxFree(void)
+{
+	return (uartTxTail - uartTxHead - 1) & UART_TX_MASK;
+}
+
+void uartSetRefill(void (*fct)(void))
+{
+	unsigned char sreg = SREG;
+
+	cli();
+	uartRefill = fct;
+	SREG = sreg;
+}
+
+void uartSetBaud(unsigned long baud)
+{
+	unsigned int ubrr = (F_CPU/8 + baud/2) / baud - 1;	// avec U2X
+	unsigned int i;
+
+	while(uartTxHead != uartTxTail)
+	{
+		if(!(SREG & (1<<SREG_I)) && (UCSRA & (1<<UDRE)))
+		{
+			uartTxNext();
+		}
+	}
+	while(!(UCSRA & (1<<UDRE)));
+	// le dernier byte est encore dans le registre à décalage: 10 bits à l'ancienne vitesse
+	for(i = (UBRRH << 8) | UBRRL; i != 0xFFFF; i--)
+	{
+		_delay_loop_1(UCSRA & (1<<U2X) ? 27 : 54);	// 80 ou 160 cycles par pas de UBRR
 	}
+	UBRRH = ubrr >> 8;
+	UBRRL = ubrr & 0xFF;
+	UCSRA |= (1<<U2X);
+}
 
-	while((UCSRA & (1<<UDRE))==0);
-	UDR = a;
+// fonction bloquante uniquement tant que le buffer d'envoi est plein
+void uartSendByte(unsigned char a)
+{
+	while(!uartPut(a))
+	{
+		// interruptions désactivées: on vide le buffer à la main
+		if(!(SREG & (1<<SREG_I)) && (UCSRA & (1<<UDRE)))
+		{
+			uartTxNext();
+		}
+	}
 }
 
 void uartSendString(const char *text)
@@ -172,35 +564,57 @@ void uartSendString(const char *text)
 	}
 }
 
+// Comme uartSendString, sans copie de la chaîne en SRAM
+void uartSendString_P(PGM_P text)
+{
+	char c;
+
+	while((c = pgm_read_byte(text++)) != '\0')
+	{
+		uartSendByte((unsigned char)c);
+	}
+}
+
 // Fonction bloquante tant qu'aucun valeur reçue sur le bus
 unsigned char uartGetByte(void)
 {
-	if(uartStatus)
+	unsigned char a;
+
+	while(uartRxHead == uartRxTail)
 	{
-		UBRRH = UBRRH_VALUE;
-		UBRRL = UBRRL_VALUE;
-		#if USE_2X
-		UCSRA |= (1 << U2X);
-		#else
-		UCSRA &= ~(1 << U2X);
-		#endif
-		UCSRB |= 0x18;
-		uartStatus = 0;
+		if(!(SREG & (1<<SREG_I)) && (UCSRA & (1<<RXC)))
+		{
+			uartRxNext();
+		}
 	}
-
-	while((UCSRA & (1<<RXC)) == 0);
-	return UDR;
+	a = uartRxBuffer[uartRxTail];
+	uartRxTail = (uartRxTail + 1) & UART_RX_MASK;
+	return a;
 }
 
+#endif
 
 
-void setupMotorPWM(int vLeft, int vRight)
+
+//FONCTIONS POUR LES MOTEURS
+//Le timer 1 n'est configuré qu'une fois; motorOutput ne change ensuite que les sorties et les rapports cycliques.
+static unsigned char motorPwmReady = 0;
+
+static void motorPwmInit(void)
 {
-	DDRD |= 0xF0;	// PD4-7 as output
-	TCCR1A = 0x03;	// PWM, phase correct, 10bits
-	TCCR1B = 0x01;
+	if(!motorPwmReady)
+	{
+		DDRD |= 0xF0;	// PD4-7 as output
+		TCCR1A = 0x03;	// PWM, phase correct, 10bits
+		TCCR1B = 0x01;
+		motorPwmReady = 1;
+	}
+}
 
-	if(vLeft==0)
+// Rapports cycliques de -1023 à 1023, interruptions désactivées (OCR1x est pris en compte en haut de rampe)
+static void motorOutput(int left, int right)
+{
+	if(left==0)
 	{
 		TCCR1A &= 0x3F;
 		PORTD &= ~(1<<PD5);
@@ -208,20 +622,18 @@ void setupMotorPWM(int vLeft, int vRight)
 	else
 	{
 		TCCR1A |= 0x80;
-		if(vLeft < 0)
+		if(left < 0)
 		{
-			vLeft = -vLeft;
+			left = -left;
 			PORTD |= (1<<PD7);
 		}
 		else
 		{
 			PORTD &= ~(1<<PD7);
 		}
-
-		vLeft = (10*vLeft); // 1023*vLeft/100
 	}
 
-	if(vRight==0)
+	if(right==0)
 	{
 		TCCR1A &= 0xCF;
 		PORTD &= ~(1<<PD4);
@@ -229,214 +641,1067 @@ void setupMotorPWM(int vLeft, int vRight)
 	else
 	{
 		TCCR1A |= 0x20;
-		if(vRight < 0)
+		if(right < 0)
 		{
-			vRight = -vRight;
+			right = -right;
 			PORTD |= (1<<PD6);
 		}
 		else
 		{
 			PORTD &= ~(1<<PD6);
 		}
-
-		vRight = (10*vRight); // 1023*vLeft/100
 	}
 
-	OCR1AH = (vLeft & 0xFF00)>>8;
-	OCR1AL = vLeft & 0xFF;
-	OCR1BH = (vRight & 0xFF00)>>8;
-	OCR1BL = vRight & 0xFF;
+	OCR1A = left;
+	OCR1B = right;
 }
 
 
+#ifndef nomotor
+typedef struct
+{
+	int target;			// donnée par motorSpeed
+	int reference;		// consigne après la rampe
+	int duty;			// rapport cyclique appliqué
+	int kp, ki;			// gains du PI en 1/256
+	long integral;		// terme intégral en 1/256 de pas de PWM
+	int count;			// pas de codeur de la période en cours
+	int measured;		// pas de codeur de la dernière période
+} motorState;
 
-#ifndef	noagenda
+#define MOTOR_DUTY_MAX		1023
+#define MOTOR_INTEGRAL_MAX	((long)MOTOR_DUTY_MAX << 8)
 
-void(*callbackFct[8])(void);
-static volatile unsigned char callbackStatus = 0;
-static volatile unsigned int timeInterval[8] = {0,0,0,0,0,0,0,0};
-static volatile unsigned char numberRepetition[8] = {0,0,0,0,0,0,0,0};
-static volatile unsigned char numberRepeted[8] = {0,0,0,0,0,0,0,0};
-static volatile unsigned long nextExecutionTime[8] = {0,0,0,0,0,0,0,0};
-static volatile unsigned long time = 0;
+// Partagés avec l'interruption: accédés interruptions désactivées hors de celle-ci
+static motorState motors[2];
+static unsigned int motorAccelMax = 0;
+static unsigned char motorTicks = MOTOR_PERIOD;
 
-// max absolute time: 8589934sec
-// time resolution ~2msec
-char addNewCallback(void (* newcallbackaddr)(void), unsigned int duration, unsigned char executionNumber)
+static int motorClamp(long value)
 {
-	unsigned char i;
+	if(value > MOTOR_DUTY_MAX)
+	{
+		return MOTOR_DUTY_MAX;
+	}
+	if(value < -MOTOR_DUTY_MAX)
+	{
+		return -MOTOR_DUTY_MAX;
+	}
+	return value;
+}
+
+static void motorControl(motorState *m)
+{
+	long error, out;
 
-	if(callbackStatus == 0)
+	if(motorAccelMax && m->target > m->reference + (long)motorAccelMax)
 	{
-		//start agenda (again) !
-		TCCR0 = 3;	// normal timer, fclk/64
-		OCR0 = 250;
-		TIMSK |= (1<<OCIE0);//(1<<TOIE0);
-		TIFR &= ~((1<<OCF0)+(1<<TOV0));
-		sei();
+		m->reference += motorAccelMax;
+	}
+	else if(motorAccelMax && m->target < m->reference - (long)motorAccelMax)
+	{
+		m->reference -= motorAccelMax;
+	}
+	else
+	{
+		m->reference = m->target;
 	}
 
-	for(i=0; i<8; i++)
+	if(m->kp || m->ki)
 	{
-		if((callbackStatus & (1<<i)) != 0)
+		error = (long)m->reference - m->measured;
+		m->integral += m->ki * error;
+		if(m->integral > MOTOR_INTEGRAL_MAX)
 		{
-			continue;
+			m->integral = MOTOR_INTEGRAL_MAX;
 		}
-
-		callbackStatus |= (1<<i);
-		callbackFct[i] = newcallbackaddr;
-		timeInterval[i] = duration;
-		numberRepetition[i] = executionNumber;
-		numberRepeted[i] = 0;
-		nextExecutionTime[i] = time + duration;
-		return i;	
+		else if(m->integral < -MOTOR_INTEGRAL_MAX)
+		{
+			m->integral = -MOTOR_INTEGRAL_MAX;
+		}
+		out = (m->kp * error + m->integral) >> 8;
 	}
-
-	return -1;
+	else
+	{
+		out = m->reference;
+	}
+	m->duty = motorClamp(out);
 }
 
-void stopCallback(char callbackNumber)
+// Commande directe: arrête la rampe et le PI sur la valeur donnée
+static void motorHold(motorState *m, int duty)
 {
-	callbackStatus &= ~(1<<callbackNumber);
-	if(callbackStatus == 0)
-	{
-		TIMSK &= ~(1<<TOIE0);
-		TCCR0=0;
-	}
+	m->target = m->reference = m->duty = duty;
+	m->kp = m->ki = 0;
+	m->integral = 0;
 }
 
-ISR(TIMER0_COMP_vect) //interruption bloquante !!
+static inline void motorIsr(void)
 {
 	unsigned char i;
-	TCNT0 = 0;
-	time++;
-	for(i=0;i<8;i++)
+
+	if(--motorTicks)
 	{
-		if((callbackStatus & (1<<i)) != 0)
-		{
-			if(nextExecutionTime[i] <= time)
-			{
-				if((numberRepeted[i] < numberRepetition[i]) || (numberRepetition[i]==0))
-				{
-					(* callbackFct[i])();
-					nextExecutionTime[i] = time + timeInterval[i];
-						
-					if((numberRepeted[i] >= (numberRepetition[i]-1)) && (numberRepetition[i] != 0))
-					{
-						callbackStatus &= ~(1<<i);
-					}
-					else
-					{	
-						numberRepeted[i]++;
-					}
-					break;
-				}
-			}
-		}
+		return;
 	}
+	motorTicks = MOTOR_PERIOD;
+
+	for(i=0; i<2; i++)
+	{
+		motors[i].measured = motors[i].count;
+		motors[i].count = 0;
+	}
+	// le calcul ne retarde ni les servos ni l'UART; seul motorEncoder touche encore à motors.
+	// TIMER1_OVF reste masqué pour ne pas se réentrer: un débordement pendant le calcul
+	// reste en attente (TOV1) et est servi juste après.
+	TIMSK &= ~(1<<TOIE1);
+	sei();
+	motorControl(&motors[MOTOR_LEFT]);
+	motorControl(&motors[MOTOR_RIGHT]);
+	cli();
+	TIMSK |= (1<<TOIE1);
+	motorOutput(motors[MOTOR_LEFT].duty, motors[MOTOR_RIGHT].duty);
 }
 
-#endif
+ISR(TIMER1_OVF_vect) // Débordement en bas de rampe, toutes les 2046 cycles
+{
+	ISR_STATS_BEGIN(TCNT1 >> 6)
+	ISR_WAKE()
+	motorIsr();
+	ISR_STATS_END(ISR_STATS_T1_OVF, TIFR & (1<<TOV1))
+}
 
+void motorInit(void)
+{
+	unsigned char sreg;
 
+	motorPwmInit();
+	sreg = SREG;
+	cli();
+	motorTicks = MOTOR_PERIOD;
+	TIMSK |= (1<<TOIE1);
+	SREG = sreg;
+	sei();
+}
 
+void motorSpeed(int left, int right)
+{
+	unsigned char sreg = SREG;
 
+	cli();
+	motors[MOTOR_LEFT].target = left;
+	motors[MOTOR_RIGHT].target = right;
+	SREG = sreg;
+}
 
-#ifndef noservo
-//FONCTION POUR LES SERVOS
-static volatile unsigned char ServoStatus = 0;
-char angle_servos[10]= {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1};
-unsigned char num_servo;
+void motorAccel(unsigned int accel)
+{
+	unsigned char sreg = SREG;
 
-//La fonction set_servos permet de controller 10 servomoteur placés physiquement sur les lignes definies dans robopoly.h
+	cli();
+	motorAccelMax = accel;
+	SREG = sreg;
+}
+
+void motorPI(unsigned char motor, int kp, int ki)
+{
+	motorState *m;
+	unsigned char sreg;
+
+	if(motor > MOTOR_RIGHT)
+	{
+		return;
+	}
+	m = &motors[motor];
+	sreg = SREG;
+	cli();
+	if(!m->kp && !m->ki)
+	{
+		m->integral = (long)m->duty << 8;	// passage sans à-coup depuis la boucle ouverte
+		m->reference = m->measured;
+	}
+	m->kp = kp;
+	m->ki = ki;
+	SREG = sreg;
+}
+
+void motorEncoder(unsigned char motor, signed char delta)
+{
+	motors[motor & 1].count += delta;
+}
+
+int motorMeasured(unsigned char motor)
+{
+	unsigned char sreg = SREG;
+	int value;
+
+	cli();
+	value = motors[motor & 1].measured;
+	SREG = sreg;
+	return value;
+}
+
+int motorTarget(unsigned char motor)
+{
+	unsigned char sreg = SREG;
+	int value;
+
+	cli();
+	value = motors[motor & 1].target;
+	SREG = sreg;
+	return value;
+}
+
+int motorDuty(unsigned char motor)
+{
+	unsigned char sreg = SREG;
+	int value;
+
+	cli();
+	value = motors[motor & 1].duty;
+	SREG = sreg;
+	return value;
+}
+#endif
+
+
+void setupMotorPWM(int vLeft, int vRight)
+{
+	unsigned char sreg;
+
+	vLeft = 10*vLeft; // 1023*vLeft/100
+	vRight = 10*vRight;
+
+	motorPwmInit();
+	sreg = SREG;
+	cli();
+#ifndef nomotor
+	motorHold(&motors[MOTOR_LEFT], vLeft);
+	motorHold(&motors[MOTOR_RIGHT], vRight);
+#endif
+	motorOutput(vLeft, vRight);
+	SREG = sreg;
+}
 
-void set_servo(unsigned char num_servo, char angle_servo)
 
+
+#ifndef notimer
+//BASE DE TEMPS
+//Le timer 0 tourne librement à fclk/64 (8us par pas). Son débordement, toutes les 2.048ms, fait avancer
+//le compteur de ticks utilisé par l'agenda; sa comparaison OCR0 sert d'alarme unique de résolution 8us.
+
+static volatile unsigned long time = 0;				// ticks de 2.048ms depuis le démarrage du timer
+static volatile unsigned long timeMs = 0;			// millisecondes entières depuis le démarrage du timer
+static volatile unsigned int timeUs = 0;			// reste en microsecondes (0 à 999)
+static void (* volatile timerAlarmFct)(void) = 0;
+static volatile unsigned char timerAlarmSkip;		// comparaisons à laisser passer avant l'alarme
+static volatile unsigned char timerAlarmRunning = 0;	// fct de l'alarme en cours: l'agenda attend sa fin
+
+void timerStart(void)
 {
-	if (ServoStatus==0)  	
+	unsigned char sreg = SREG;
+
+	cli();
+	if(TCCR0 == 0)
 	{
-		ServoStatus	= 1;	// initialisation uniquement lors du premier appel de la fct set_servo
-		TCCR2 		= 5;	// normal timer, fclk/128 => resolution 16us
-		OCR2 		= 250;  // a regler pour chaque servo entre 125 (1ms) et 250 (2ms). 125 correspondant à 0% et 250 à 100%
-		TCNT2		= 100;	// pour arriver à 2ms on compte de 100 à 255 = 155 cycles à 16us = 2.48ms
-		TIFR 		&= ~((1<<OCF2)+(1<<TOV2));	//MAZ des flags
-		TIMSK 		|=  (1<<OCIE2)+(1<<TOIE2); //activation des interrupts COMP et OVF du timer 2
-		sei(); 				//Active les interruptions globales
+		TCNT0 = 0;
+		TCCR0 = 3;					// normal timer, fclk/64
+		TIFR = (1<<TOV0);
+		TIMSK |= (1<<TOIE0);
 	}
+	SREG = sreg;
+}
 
-	if ((angle_servo<101)&&(angle_servo>=0))
+// Appelle fct depuis l'interruption TIMER0_COMP dans ticks x 8us (min 2, max 65535 soit ~524ms).
+// Il n'y a qu'une alarme: un nouvel appel remplace l'alarme en attente.
+void timerAlarm(unsigned int ticks, void (*fct)(void))
+{
+	unsigned char sreg = SREG;
+	unsigned int first;
+
+	if(ticks < 2)
+	{
+		ticks = 2;
+	}
+	timerStart();
+
+	cli();
+	OCR0 = TCNT0 + (unsigned char)ticks;
+	first = ((ticks - 1) & 0xFF) + 1;		// la première comparaison arrive dans 1..256 pas
+	timerAlarmSkip = (ticks - first) >> 8;
+	timerAlarmFct = fct;
+	TIFR = (1<<OCF0);
+	TIMSK |= (1<<OCIE0);
+	SREG = sreg;
+}
+
+void timerAlarmCancel(void)
+{
+	unsigned char sreg = SREG;
+
+	cli();
+	TIMSK &= ~(1<<OCIE0);
+	timerAlarmFct = 0;
+	SREG = sreg;
+}
+
+// Lit le compteur de ticks et TCNT0 ensemble, interruptions désactivées.
+// Un débordement pas encore traité par l'interruption est compté (TOV0 levé, TCNT0 déjà reparti).
+static unsigned char timerRead(unsigned long *ticks)
+{
+	unsigned char count = TCNT0;
+
+	*ticks = time;
+	if((TIFR & (1<<TOV0)) && count < 255)
 	{
-		angle_servos[num_servo] = (angle_servo)+150; 	
-		// OCR2-TCNT2 = nbre de cycle avec la ligne du servo à 1 (logique)
-		// ex:  angle = 0,   COMPARE après  50cycles à 16us = 0.8ms
-		// ex:  angle = 100, COMPARE après 150cycles à 16us = 2.4ms
+		(*ticks)++;
+	}
+	return count;
+}
+
+unsigned long timerTicks(void)
+{
+	unsigned char sreg = SREG;
+	unsigned long ticks;
+
+	cli();
+	timerRead(&ticks);
+	SREG = sreg;
+	return ticks;
+}
+
+unsigned long micros(void)
+{
+	unsigned char sreg = SREG;
+	unsigned long ticks;
+	unsigned char count;
+
+	cli();
+	count = timerRead(&ticks);
+	SREG = sreg;
+	return ((ticks << 8) | count) << 3;
+}
+
+unsigned long millis(void)
+{
+	unsigned char sreg = SREG;
+	unsigned long ms;
+	unsigned char count;
+	unsigned int us;
+
+	cli();
+	count = TCNT0;
+	ms = timeMs;
+	us = timeUs + (count << 3);
+	if((TIFR & (1<<TOV0)) && count < 255)
+	{
+		us += 2048;
+	}
+	SREG = sreg;
+	return ms + us / 1000;
+}
+
+// Echéance dans us microsecondes (au plus ~35 minutes)
+unsigned long timeoutStart(unsigned long us)
+{
+	timerStart();
+	return micros() + us;
+}
+
+unsigned char timeoutExpired(unsigned long deadline)
+{
+	return (long)(micros() - deadline) >= 0;
+}
+
+static inline void timerAlarmIsr(void)
+{
+	void (*fct)(void);
+
+	if(timerAlarmSkip)
+	{
+		timerAlarmSkip--;
+		return;
+	}
+	TIMSK &= ~(1<<OCIE0);
+	fct = timerAlarmFct;
+	timerAlarmFct = 0;
+	if(fct)
+	{
+		timerAlarmRunning = 1;
+		(* fct)();
+		timerAlarmRunning = 0;
+	}
+}
 
-		switch (num_servo)		
+ISR(TIMER0_COMP_vect)
+{
+	ISR_STATS_BEGIN(TCNT0 - OCR0)
+	ISR_WAKE()
+	timerAlarmIsr();
+	ISR_STATS_END(ISR_STATS_T0_COMP, TIFR & (1<<OCF0))
+}
+
+#elif !defined(noagenda)
+#error "l'agenda utilise le timer 0: -D notimer demande aussi -D noagenda"
+#endif
+
+
+
+#ifndef	noagenda
+
+#if AGENDA_SLOTS > 127
+#error "AGENDA_SLOTS ne peut pas dépasser 127"
+#endif
+
+#define AGENDA_FREE		0		// slot libre
+#define AGENDA_RUNNING	0xFF	// callback en cours d'exécution (hors du tas)
+
+typedef struct
+{
+	void (*fct)(void);
+	unsigned int interval;
+	unsigned char remaining;	// nombre d'exécutions restantes, 0 = infini
+	unsigned int deadline;		// prochaine exécution (16 bits de poids faible du compteur de ticks)
+} agendaSlot;
+
+// Les slots actifs sont rangés dans un tas binaire trié par échéance:
+// agendaHeap[0] est toujours le prochain callback à exécuter.
+static agendaSlot agenda[AGENDA_SLOTS];
+static unsigned char agendaHeap[AGENDA_SLOTS];
+static unsigned char agendaPos[AGENDA_SLOTS];	// position+1 de chaque slot dans le tas, AGENDA_FREE ou AGENDA_RUNNING
+static volatile unsigned char agendaCount = 0;	// nombre de slots dans le tas
+static volatile unsigned int agendaNext = 0;	// échéance de agendaHeap[0]
+static volatile unsigned char agendaBusy = 0;
+
+// comparaison tolérante au débordement du compteur de temps, valable pour des échéances à moins de 32768 ticks
+#define AGENDA_DUE(deadline, now)	((int)((unsigned int)(now) - (deadline)) >= 0)
+#define AGENDA_MAX_DURATION			32767
+
+static unsigned char agendaBefore(unsigned char a, unsigned char b)
+{
+	return (int)(agenda[a].deadline - agenda[b].deadline) < 0;
+}
+
+static void agendaSwap(unsigned char i, unsigned char j)
+{
+	unsigned char a = agendaHeap[i];
+
+	agendaHeap[i] = agendaHeap[j];
+	agendaHeap[j] = a;
+	agendaPos[agendaHeap[i]] = i + 1;
+	agendaPos[agendaHeap[j]] = j + 1;
+}
+
+static void agendaSiftUp(unsigned char i)
+{
+	unsigned char parent;
+
+	while(i > 0)
+	{
+		parent = (i - 1) >> 1;
+		if(!agendaBefore(agendaHeap[i], agendaHeap[parent]))
 		{
-			case 0:		SERVO_0_DIR = 1; break;
-			case 1:	 	SERVO_1_DIR = 1; break;
-			case 2:		SERVO_2_DIR = 1; break;
-			case 3:	 	SERVO_3_DIR = 1; break;
-			case 4:		SERVO_4_DIR = 1; break;
-			case 5:	 	SERVO_5_DIR = 1; break;
-			case 6:		SERVO_6_DIR = 1; break;
-			case 7:	 	SERVO_7_DIR = 1; break;
-			case 8:		SERVO_8_DIR = 1; break;
-			case 9:	 	SERVO_9_DIR = 1; break;
+			break;
 		}
+		agendaSwap(i, parent);
+		i = parent;
 	}
 }
 
-
-ISR(TIMER2_COMP_vect) //interruption bloquante !!  Mise de zéro des lignes des servos jusqu'au COMP suivant
+static void agendaSiftDown(unsigned char i)
 {
-	if (angle_servos[num_servo]  != -1)
+	unsigned char child, smallest;
+
+	for(;;)
 	{
-		switch (num_servo)
+		smallest = i;
+		child = 2*i + 1;
+		if(child < agendaCount && agendaBefore(agendaHeap[child], agendaHeap[smallest]))
 		{
-			case 0:		SERVO_0 = 0; break;
-			case 1:	 	SERVO_1 = 0; break;
-			case 2:		SERVO_2 = 0; break;
-			case 3:	 	SERVO_3 = 0; break;
-			case 4:		SERVO_4 = 0; break;
-			case 5:	 	SERVO_5 = 0; break;
-			case 6:		SERVO_6 = 0; break;
-			case 7:	 	SERVO_7 = 0; break;
-			case 8:		SERVO_8 = 0; break;
-			case 9:	 	SERVO_9 = 0; break;
+			smallest = child;
 		}
+		child++;
+		if(child < agendaCount && agendaBefore(agendaHeap[child], agendaHeap[smallest]))
+		{
+			smallest = child;
+		}
+		if(smallest == i)
+		{
+			break;
+		}
+		agendaSwap(i, smallest);
+		i = smallest;
 	}
 }
 
+// Les fonctions suivantes doivent être appelées interruptions désactivées
+static void agendaInsert(unsigned char slot)
+{
+	unsigned char i = agendaCount++;
 
-ISR(TIMER2_OVF_vect) //interruption bloquante !! Mise à un des lignes des servos jusqu'au OVF suivant
+	agendaHeap[i] = slot;
+	agendaPos[slot] = i + 1;
+	agendaSiftUp(i);
+	agendaNext = agenda[agendaHeap[0]].deadline;
+}
+
+static void agendaRemove(unsigned char i)
 {
-	TCNT2	= 100;	// pour arriver à 2.48ms on compte de 100 à 255 (=155 cycles de 16us)
-	num_servo++;
-	if (num_servo>=10) num_servo=0;
+	unsigned char last = --agendaCount;
+	unsigned char slot;
+
+	agendaPos[agendaHeap[i]] = AGENDA_FREE;
+	if(i != last)
+	{
+		slot = agendaHeap[last];
+		agendaHeap[i] = slot;
+		agendaPos[slot] = i + 1;
+		agendaSiftUp(i);
+		agendaSiftDown(agendaPos[slot] - 1);
+	}
+	if(agendaCount)
+	{
+		agendaNext = agenda[agendaHeap[0]].deadline;
+	}
+}
 
-	
-	//Reglage du temps que la ligne va rester à 1.
-	OCR2 = angle_servos[num_servo];
+// time resolution 2.048msec
+// les durées sont limitées à 32767 ticks (~67sec), le compteur de temps peut déborder sans problème
+char addNewCallback(void (* newcallbackaddr)(void), unsigned int duration, unsigned char executionNumber)
+{
+	unsigned char i, sreg;
 
+	if(duration == 0)
+	{
+		duration = 1;	// au plus une exécution par tick
+	}
+	if(duration > AGENDA_MAX_DURATION)
+	{
+		duration = AGENDA_MAX_DURATION;
+	}
 
-	if (angle_servos[num_servo]  != -1)
+	sreg = SREG;
+	cli();
+	for(i=0; i<AGENDA_SLOTS; i++)
 	{
-	switch (num_servo)
+		if(agendaPos[i] != AGENDA_FREE)
 		{
-			case 0:		SERVO_0 = 1; break;
-			case 1:	 	SERVO_1 = 1; break;
-			case 2:		SERVO_2 = 1; break;
-			case 3:	 	SERVO_3 = 1; break;
-			case 4:		SERVO_4 = 1; break;
-			case 5:	 	SERVO_5 = 1; break;
-			case 6:		SERVO_6 = 1; break;
-			case 7:	 	SERVO_7 = 1; break;
-			case 8:		SERVO_8 = 1; break;
-			case 9:	 	SERVO_9 = 1; break;
+			continue;
 		}
+
+		agenda[i].fct = newcallbackaddr;
+		agenda[i].interval = duration;
+		agenda[i].remaining = executionNumber;
+		agenda[i].deadline = (unsigned int)time + duration;
+		agendaInsert(i);
+		break;
+	}
+	SREG = sreg;
+
+	if(i == AGENDA_SLOTS)
+	{
+		return -1;
+	}
+
+	timerStart();
+	sei();		// comme analogScanStart: les callbacks ont besoin des interruptions
+	return i;
+}
+
+void stopCallback(char callbackNumber)
+{
+	unsigned char sreg = SREG;
+	unsigned char pos;
+
+	if((unsigned char)callbackNumber >= AGENDA_SLOTS)
+	{
+		return;
+	}
+
+	cli();
+	pos = agendaPos[(unsigned char)callbackNumber];
+	if(pos == AGENDA_RUNNING)
+	{
+		agendaPos[(unsigned char)callbackNumber] = AGENDA_FREE;	// le dispatcher ne le replanifiera pas
+	}
+	else if(pos != AGENDA_FREE)
+	{
+		agendaRemove(pos - 1);
 	}
+	SREG = sreg;
+}
+
+// Exécute tous les callbacks arrivés à échéance, par ordre d'échéance.
+// Les callbacks sont appelés avec les interruptions dans l'état de l'appelant.
+void agendaDispatch(void)
+{
+	unsigned char sreg = SREG;
+	unsigned char slot;
+	void (*fct)(void);
+
+	cli();
+	if(agendaBusy)
+	{
+		SREG = sreg;
+		return;
+	}
+	agendaBusy = 1;
+
+	while(agendaCount && AGENDA_DUE(agendaNext, time))
+	{
+		slot = agendaHeap[0];
+		agendaRemove(0);
+		agendaPos[slot] = AGENDA_RUNNING;
+		fct = agenda[slot].fct;
+
+		SREG = sreg;
+		(* fct)();
+		cli();
+
+		if(agendaPos[slot] != AGENDA_RUNNING)
+		{
+			continue;	// arrêté pendant l'exécution
+		}
+
+		if(agenda[slot].remaining == 1)
+		{
+			agendaPos[slot] = AGENDA_FREE;	// dernière exécution
+			continue;
+		}
+		if(agenda[slot].remaining != 0)
+		{
+			agenda[slot].remaining--;
+		}
+
+		// replanification par rapport à l'échéance précédente (pas de dérive),
+		// les exécutions manquées après un retard d'une période entière sont sautées
+		agenda[slot].deadline += agenda[slot].interval;
+		if(AGENDA_DUE(agenda[slot].deadline, time))
+		{
+			agenda[slot].deadline = (unsigned int)time + agenda[slot].interval;
+		}
+		agendaInsert(slot);
+	}
+
+	agendaBusy = 0;
+	SREG = sreg;
+}
+
+// Appelée à chaque tick, ne fait qu'une comparaison avec l'échéance la plus proche, O(1)
+static inline void agendaTick(void)
+{
+	// pas de callbacks par-dessus une alarme qui a réactivé les interruptions (lecture de la caméra):
+	// ils attendent le tick suivant, la pile reste bornée
+	if(agendaCount && AGENDA_DUE(agendaNext, time) && !agendaBusy && !timerAlarmRunning)
+	{
+		#ifndef AGENDA_DEFERRED
+		// les callbacks tournent avec les interruptions actives pour ne pas bloquer uart, servos, ...
+		sei();
+		agendaDispatch();
+		#endif
+	}
+}
+
+#endif
+
+
+#ifndef notimer
+ISR(TIMER0_OVF_vect)
+{
+	ISR_STATS_BEGIN(TCNT0)
+	ISR_WAKE()
+	time++;
+	ISR_STATS_REBASE()
+	timeMs += 2;
+	timeUs += 48;
+	if(timeUs >= 1000)
+	{
+		timeUs -= 1000;
+		timeMs++;
+	}
+	#ifndef noagenda
+	agendaTick();
+	#endif
+	ISR_STATS_END(ISR_STATS_T0_OVF, TIFR & (1<<TOV0))
+}
+#endif
+
+
+#ifdef ISR_STATS
+static unsigned long isrStatsStart = 0;	// valeur de time au dernier isrStatsReset
+
+void isrStatsReset(void)
+{
+	unsigned char *bytes = (unsigned char *)isrStats;
+	unsigned char sreg;
+	unsigned int i;		// 13 bytes par vecteur
+
+	timerStart();
+	sreg = SREG;
+	cli();
+	for(i=0; i<sizeof(isrStats); i++)
+	{
+		bytes[i] = 0;
+	}
+	isrStatsStart = time;
+	SREG = sreg;
+}
+
+unsigned int isrStatsEnter(void)
+{
+	return isrStatsNow();
+}
+
+void isrStatsLeave(unsigned char vector, unsigned int entry, unsigned int latency, unsigned char overrun)
+{
+	isrStatsRecord(vector, entry, latency, overrun);
+}
+
+void isrStatsGet(unsigned char vector, isrStat *stat)
+{
+	unsigned char sreg = SREG;
+
+	if(vector >= ISR_STATS_COUNT)
+	{
+		return;
+	}
+	cli();
+	*stat = isrStats[vector];
+	SREG = sreg;
+}
+
+unsigned char isrStatsIdle(void)
+{
+	unsigned char sreg = SREG;
+	unsigned long busy = 0, elapsed;
+	unsigned char i;
+
+	cli();
+	for(i=0; i<ISR_STATS_COUNT; i++)
+	{
+		busy += isrStats[i].durationTotal;
+	}
+	elapsed = ((time - isrStatsStart) << 8) / 100;	// en centièmes, pas de 8us
+	SREG = sreg;
+
+	if(elapsed == 0)
+	{
+		return 100;
+	}
+	busy /= elapsed;
+	return (busy >= 100) ? 0 : 100 - busy;
+}
+
+#ifndef nouart
+static void isrStatsSendNumber(unsigned long value)
+{
+	char text[11];
+
+	uartSendByte('\t');
+	uartSendString(ultoa(value, text, 10));
+}
+
+// Une ligne par interruption: nom, appels, retard max, durée max et moyenne (en us), dépassements
+void isrStatsDump(void)
+{
+	static const char names[] PROGMEM = "t0_comp\0t0_ovf\0t1_ovf\0t2_comp\0t2_ovf\0adc\0uart_rx\0uart_udre\0"
+		"int0\0int1\0int2\0ee_rdy\0twi";
+	PGM_P name = names;
+	isrStat stat;
+	unsigned char i;
+
+	uartSendString_P(PSTR("isr\tcount\tlatency_us\tmax_us\tavg_us\toverruns\n"));
+	for(i=0; i<ISR_STATS_COUNT; i++)
+	{
+		isrStatsGet(i, &stat);
+		uartSendString_P(name);
+		name += strlen_P(name) + 1;
+		isrStatsSendNumber(stat.count);
+		isrStatsSendNumber(stat.latencyMax * 8UL);
+		isrStatsSendNumber(stat.durationMax * 8UL);
+		isrStatsSendNumber(stat.count ? stat.durationTotal * 8 / stat.count : 0);
+		isrStatsSendNumber(stat.overruns);
+		uartSendByte('\n');
+	}
+	uartSendString_P(PSTR("idle"));
+	isrStatsSendNumber(isrStatsIdle());
+	uartSendByte('\n');
 }
 #endif
+#endif
+
+
+
+
+
+#ifndef noservo
+//FONCTION POUR LES SERVOS
+//Chaque servo est décrit par sa ligne (port et bit dans un byte) et la largeur de son impulsion.
+//Au début de chaque trame toutes les lignes actives passent à 1, puis l'interruption COMP du timer 2
+//les remet à zéro dans l'ordre croissant des largeurs. Timer 2 à fclk/128 => résolution 16us.
+
+#define SERVO_FRAME_TICKS	(SERVO_FRAME_US / 16)
+#define SERVO_FRAME_PERIODS	((SERVO_FRAME_TICKS + 255) / 256)		// débordements du timer par trame
+#define SERVO_LAST_PRELOAD	(SERVO_FRAME_PERIODS*256 - SERVO_FRAME_TICKS)	// raccourcit le dernier débordement
+
+#if SERVO_FRAME_PERIODS < 2
+#error "SERVO_FRAME_US doit être supérieur à 4096us"
+#endif
+
+#define SERVO_LINE(port, bit)	((((port) - 'A') << 3) | (bit))
+#define SERVO_NONE				0xFF	// servo branché nulle part
+#define SERVO_PORT(line)		GPIO_PORT('A' + ((line) >> 3))
+
+typedef struct
+{
+	unsigned char line;				// SERVO_LINE ou SERVO_NONE
+	unsigned char width;			// durée de l'impulsion en pas de 16us, 0 = inactif
+} servoChannel;
+
+typedef struct
+{
+	unsigned char width;
+	unsigned char line;
+} servoEdge;
+
+static servoChannel servos[SERVO_COUNT];
+static servoEdge servoEdges[2][SERVO_COUNT];	// fronts descendants triés, liste active et liste en préparation
+static unsigned char servoEdgeCount[2];
+static unsigned char servoRaise[2][4];			// lignes à mettre à 1 en début de trame, pour PORTA..PORTD
+static volatile unsigned char servoActive = 0;	// liste utilisée par les interruptions
+static volatile unsigned char servoUpdate = 0;	// la liste en préparation remplace l'active à la prochaine trame
+static unsigned char servoNextEdge;
+static unsigned char servoPeriod;
+static unsigned char ServoStatus = 0;
+
+static const unsigned char servoDefaults[10] PROGMEM =
+{
+	SERVO_LINE(SERVO_0_PORT, SERVO_0_BIT), SERVO_LINE(SERVO_1_PORT, SERVO_1_BIT), SERVO_LINE(SERVO_2_PORT, SERVO_2_BIT),
+	SERVO_LINE(SERVO_3_PORT, SERVO_3_BIT), SERVO_LINE(SERVO_4_PORT, SERVO_4_BIT), SERVO_LINE(SERVO_5_PORT, SERVO_5_BIT),
+	SERVO_LINE(SERVO_6_PORT, SERVO_6_BIT), SERVO_LINE(SERVO_7_PORT, SERVO_7_BIT), SERVO_LINE(SERVO_8_PORT, SERVO_8_BIT),
+	SERVO_LINE(SERVO_9_PORT, SERVO_9_BIT)
+};
+static const unsigned char servoMasks[8] PROGMEM = {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80};
+
+static inline unsigned char servoMask(unsigned char line)
+{
+	return pgm_read_byte(&servoMasks[line & 7]);
+}
+
+// Prépare la liste triée des fronts et la passe aux interruptions pour la trame suivante
+static void servoBuild(void)
+{
+	unsigned char sreg = SREG;
+	unsigned char list, i, j, n = 0;
+	servoEdge *edges;
+
+	cli();
+	servoUpdate = 0;	// l'ISR ne touche plus à la liste en préparation
+	list = servoActive ^ 1;
+	SREG = sreg;
+
+	edges = servoEdges[list];
+	for(i=0; i<4; i++)
+	{
+		servoRaise[list][i] = 0;
+	}
+
+	for(i=0; i<SERVO_COUNT; i++)
+	{
+		if(servos[i].width == 0 || servos[i].line == SERVO_NONE)
+		{
+			continue;
+		}
+		servoRaise[list][servos[i].line >> 3] |= servoMask(servos[i].line);
+
+		// tri par insertion, au plus SERVO_COUNT éléments
+		for(j=n; j>0 && edges[j-1].width > servos[i].width; j--)
+		{
+			edges[j] = edges[j-1];
+		}
+		edges[j].width = servos[i].width;
+		edges[j].line = servos[i].line;
+		n++;
+	}
+	servoEdgeCount[list] = n;
+
+	servoUpdate = 1;
+}
+
+static void servoInit(void)
+{
+	unsigned char i, sreg;
+
+	ServoStatus = 1;	// initialisation uniquement lors du premier appel
+	for(i=0; i<SERVO_COUNT; i++)
+	{
+		servos[i].line = (i < 10) ? pgm_read_byte(&servoDefaults[i]) : SERVO_NONE;
+	}
+
+	sreg = SREG;
+	cli();
+	servoPeriod = SERVO_FRAME_PERIODS - 1;	// la trame commence au prochain débordement
+	TCNT2 		= 0;
+	TCCR2 		= 5;	// normal timer, fclk/128 => resolution 16us
+	TIFR 		= (1<<OCF2)|(1<<TOV2);	//MAZ des flags
+	TIMSK 		|= (1<<TOIE2); 	// COMP est activée à chaque début de trame
+	SREG = sreg;
+	sei(); 				//Active les interruptions globales
+}
+
+//Branche le servo num_servo sur la ligne bit du port ('A' à 'D')
+void servoAttach(unsigned char num_servo, unsigned char port, unsigned char bit)
+{
+	unsigned char sreg;
+
+	if(num_servo >= SERVO_COUNT || port < 'A' || port > 'D' || bit > 7)
+	{
+		return;
+	}
+	if(ServoStatus == 0)
+	{
+		servoInit();
+	}
+
+	// on retire d'abord le servo des trames en cours avant de changer sa ligne
+	if(servos[num_servo].width != 0)
+	{
+		servoDisable(num_servo);
+		while(servoUpdate && (SREG & (1<<SREG_I)));	// au plus une trame
+	}
+
+	sreg = SREG;
+	cli();
+	if(servos[num_servo].line != SERVO_NONE)
+	{
+		*SERVO_PORT(servos[num_servo].line) &= ~servoMask(servos[num_servo].line);
+	}
+	servos[num_servo].line = SERVO_LINE(port, bit);
+	*GPIO_PORT(port) &= ~(1 << bit);
+	SREG = sreg;
+}
+
+//La fonction set_servo permet de controller jusqu'à SERVO_COUNT servomoteurs (10 placés physiquement sur les lignes definies dans robopoly.h par défaut)
+void set_servo(unsigned char num_servo, char angle_servo)
+{
+	unsigned char sreg;
+
+	if(num_servo >= SERVO_COUNT)
+	{
+		return;
+	}
+	if (ServoStatus==0)
+	{
+		servoInit();
+	}
+
+	if ((angle_servo<101)&&(angle_servo>=0) && servos[num_servo].line != SERVO_NONE)
+	{
+		// ex:  angle = 0,   impulsion de  50 pas de 16us = 0.8ms
+		// ex:  angle = 100, impulsion de 150 pas de 16us = 2.4ms
+		servos[num_servo].width = angle_servo + 50;
+
+		sreg = SREG;
+		cli();
+		*(SERVO_PORT(servos[num_servo].line) - 1) |= servoMask(servos[num_servo].line);	// DDRx précède PORTx (voir GPIO_DDR)
+		SREG = sreg;
+
+		servoBuild();
+	}
+}
+
+//Arrête l'envoi des impulsions au servo num_servo (la ligne reste à zéro)
+void servoDisable(unsigned char num_servo)
+{
+	if(num_servo >= SERVO_COUNT || servos[num_servo].width == 0)
+	{
+		return;
+	}
+	servos[num_servo].width = 0;
+	servoBuild();
+}
+
 
+static inline void servoEdgeIsr(void)
+{
+	unsigned char list = servoActive;
+	unsigned char i = servoNextEdge;
+	const servoEdge *edge;
+
+	for(;;)
+	{
+		edge = &servoEdges[list][i];
+		*SERVO_PORT(edge->line) &= ~servoMask(edge->line);
 
+		i++;
+		if(i >= servoEdgeCount[list])
+		{
+			TIMSK &= ~(1<<OCIE2);	// plus de front dans cette trame
+			break;
+		}
+		OCR2 = edge[1].width;
+		if(edge[1].width > TCNT2)
+		{
+			break;	// les fronts de même largeur (ou déjà dépassés) sont traités tout de suite
+		}
+	}
+	servoNextEdge = i;
+}
+
+ISR(TIMER2_COMP_vect) // Mise à zéro des lignes dont l'impulsion est terminée
+{
+	ISR_STATS_BEGIN((unsigned int)(unsigned char)(TCNT2 - OCR2) << 1)
+	ISR_WAKE()
+	servoEdgeIsr();
+	ISR_STATS_END(ISR_STATS_T2_COMP, TIFR & (1<<OCF2))
+}
+
+
+static inline void servoFrameIsr(void)
+{
+	unsigned char list;
+
+	servoPeriod++;
+	#if SERVO_LAST_PRELOAD
+	if(servoPeriod == SERVO_FRAME_PERIODS - 1)
+	{
+		TCNT2 = SERVO_LAST_PRELOAD;
+		return;
+	}
+	#endif
+	if(servoPeriod < SERVO_FRAME_PERIODS)
+	{
+		return;
+	}
+
+	servoPeriod = 0;
+	if(servoUpdate)
+	{
+		servoActive ^= 1;
+		servoUpdate = 0;
+	}
+	list = servoActive;
+	if(servoEdgeCount[list] == 0)
+	{
+		return;
+	}
+
+	PORTA |= servoRaise[list][0];
+	PORTB |= servoRaise[list][1];
+	PORTC |= servoRaise[list][2];
+	PORTD |= servoRaise[list][3];
+
+	servoNextEdge = 0;
+	OCR2 = servoEdges[list][0].width;
+	TIFR = (1<<OCF2);
+	TIMSK |= (1<<OCIE2);
+}
+
+ISR(TIMER2_OVF_vect) // Découpage de la trame et mise à un des lignes en début de trame
+{
+	ISR_STATS_BEGIN((unsigned int)TCNT2 << 1)
+	ISR_WAKE()
+	servoFrameIsr();
+	ISR_STATS_END(ISR_STATS_T2_OVF, TIFR & (1<<TOV2))
+}
+#endif
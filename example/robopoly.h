@@ -15,6 +15,15 @@
 
 #ifndef _ROBOPOLY_H
 #define _ROBOPOLY_H
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+
+// L'ATmega16 (même brochage, utilisé par le banc de mesure sous simavr) nomme différemment le vecteur de réception
+#if !defined(USART_RX_vect) && defined(USART_RXC_vect)
+#define USART_RX_vect	USART_RXC_vect
+#endif
  
 typedef struct
 	{
@@ -153,25 +162,248 @@ typedef struct
 
 // Fonctions
 
-//#define lineWrite(port,bit, value)		{_SFR_IO8(_SFR_IO_ADDR(port)-1) |= (1<<bit); port = (port & (~(1<<bit))) + (value << bit);}
-//#define lineRead(port, bit, result)		{_SFR_IO8(_SFR_IO_ADDR(port)-1) &= ~(1<<bit); result = (_SFR_IO8(_SFR_IO_ADDR(port)-2) >> bit) & 1;}
-void digitalWrite (unsigned char port, unsigned char bit, unsigned char value);
-unsigned char digitalRead (unsigned char port, unsigned char bit);
+// Registres d'un port 'A'..'D': PINx, DDRx et PORTx se suivent, et les ports se suivent tous les 3 registres.
+// Avec un port constant l'adresse est connue à la compilation.
+#define GPIO_PORT(port)	(&PORTA - 3*((port) - 'A'))
+#define GPIO_DDR(port)	(GPIO_PORT(port) - 1)
+#define GPIO_PIN(port)	(GPIO_PORT(port) - 2)
+
+#define GPIO_CONST(port, bit)	(__builtin_constant_p(port) && __builtin_constant_p(bit) \
+								&& (port) >= 'A' && (port) <= 'D' && (bit) < 8)
+
+// Versions appelées quand le port ou la ligne ne sont pas des constantes (voir robopoly.c)
+void digitalWriteRuntime(unsigned char port, unsigned char bit, unsigned char value);
+unsigned char digitalReadRuntime(unsigned char port, unsigned char bit);
+void digitalWriteMaskRuntime(unsigned char port, unsigned char mask, unsigned char value);
+
+// digitalWrite, digitalRead et digitalWriteMask sont inline: avec un port et une ligne constants,
+// ex: digitalWrite(C,2,1), elles se réduisent à des instructions sbi/cbi/sbis (atomiques).
+// bit = BYTE écrit ou lit le port entier.
+static inline void digitalWrite(unsigned char port, unsigned char bit, unsigned char value) __attribute__((always_inline));
+static inline void digitalWrite(unsigned char port, unsigned char bit, unsigned char value)
+{
+	if(GPIO_CONST(port, bit))
+	{
+		*GPIO_DDR(port) |= (1<<bit);
+		if(value)
+		{
+			*GPIO_PORT(port) |= (1<<bit);
+		}
+		else
+		{
+			*GPIO_PORT(port) &= ~(1<<bit);
+		}
+	}
+	else
+	{
+		digitalWriteRuntime(port, bit, value);
+	}
+}
+
+static inline unsigned char digitalRead(unsigned char port, unsigned char bit) __attribute__((always_inline));
+static inline unsigned char digitalRead(unsigned char port, unsigned char bit)
+{
+	if(GPIO_CONST(port, bit))
+	{
+		*GPIO_DDR(port) &= ~(1<<bit);
+		return (*GPIO_PIN(port) & (1<<bit)) ? 1 : 0;
+	}
+	return digitalReadRuntime(port, bit);
+}
+
+// Ecrit en un seul accès les lignes du port sélectionnées par mask: PORTx = (PORTx & ~mask) | (value & mask)
+static inline void digitalWriteMask(unsigned char port, unsigned char mask, unsigned char value) __attribute__((always_inline));
+static inline void digitalWriteMask(unsigned char port, unsigned char mask, unsigned char value)
+{
+	unsigned char sreg;
+
+	if(GPIO_CONST(port, 0) && __builtin_constant_p(mask) && mask && (mask & (mask - 1)) == 0)
+	{
+		// une seule ligne: sbi/cbi
+		*GPIO_DDR(port) |= mask;
+		if(value & mask)
+		{
+			*GPIO_PORT(port) |= mask;
+		}
+		else
+		{
+			*GPIO_PORT(port) &= ~mask;
+		}
+	}
+	else if(GPIO_CONST(port, 0))
+	{
+		sreg = SREG;
+		cli();
+		*GPIO_DDR(port) |= mask;
+		*GPIO_PORT(port) = (*GPIO_PORT(port) & ~mask) | (value & mask);
+		SREG = sreg;
+	}
+	else
+	{
+		digitalWriteMaskRuntime(port, mask, value);
+	}
+}
+
 unsigned char analogReadPortA(unsigned char bit);
 
+/// To disable the ADC scanner, juste add the '-D noadc=definition' compilation rule to entire project.
+#ifndef noadc
+// Résolution des mesures du scanner: 8 ou 10 bits
+#ifndef ADC_BITS
+#define ADC_BITS		8
+#endif
+// Nombre de conversions moyennées pour chaque mesure (puissance de deux, max 64)
+#ifndef ADC_OVERSAMPLE
+#define ADC_OVERSAMPLE	1
+#endif
+
+#if ADC_BITS == 10
+typedef unsigned int analog_t;
+#else
+typedef unsigned char analog_t;
+#endif
+
+// Le scanner mesure en continu sous interruption les lignes du port A données par le masque channels.
+// analogGet retourne immédiatement la dernière mesure complète d'une ligne; analogSequence est incrémenté
+// à chaque balayage de toutes les lignes, ce qui permet de savoir si une mesure est nouvelle (0 = aucune mesure).
+void analogScanStart(unsigned char channels);
+void analogScanStop(void);
+analog_t analogGet(unsigned char channel);
+unsigned char analogSequence(void);
+#endif
+
+// waitms dort entre les interruptions du timer 0 (qu'elle démarre) quand les interruptions sont actives.
 void waitms(unsigned int iter);
-void waitus(unsigned char iter);
+void waitus(unsigned char iter);		// attente active, 1 à 255us
 
 
-void uartSendByte(unsigned char a);
+/// To disable the interrupt driven UART, juste add the '-D nouart=definition' compilation rule to entire project.
+#ifndef nouart
+// Taille des buffers circulaires d'envoi et de réception (puissance de deux, max 256).
+// Peuvent être redéfinis avec '-D UART_TX_BUFFER_SIZE=64' par exemple.
+#ifndef UART_TX_BUFFER_SIZE
+#define UART_TX_BUFFER_SIZE	32
+#endif
+#ifndef UART_RX_BUFFER_SIZE
+#define UART_RX_BUFFER_SIZE	16
+#endif
+
+// uartInit doit être appelée une fois avant toute autre fonction uart (active les interruptions).
+void uartInit(void);
+void uartSendByte(unsigned char a);			// bloque seulement si le buffer d'envoi est plein
 void uartSendString(const char *text);
-unsigned char uartGetByte(void);
+void uartSendString_P(PGM_P text);		// chaîne en flash, ex: uartSendString_P(PSTR("bonjour\n"))
+unsigned char uartGetByte(void);			// bloque tant que rien n'a été reçu
+
+unsigned char uartWrite(const unsigned char *data, unsigned char length);	// non bloquante, retourne le nombre de bytes acceptés
+unsigned char uartRead(unsigned char *data, unsigned char length);		// non bloquante, retourne le nombre de bytes lus
+unsigned char uartAvailable(void);			// nombre de bytes reçus en attente
+unsigned char uartTxFree(void);				// place libre dans le buffer d'envoi
+// fct est appelée par l'interruption d'envoi, interruptions actives, quand le buffer d'envoi vient de se vider
+// à moitié ou complètement: elle peut le remplir au rythme de l'UART au lieu d'attendre l'agenda (0: aucune).
+void uartSetRefill(void (*fct)(void));
+// Change la vitesse après avoir vidé le buffer d'envoi (U2X, erreur < 1% pour 38400, 76800, 250000, 500000 et 1000000)
+void uartSetBaud(unsigned long baud);
+
+extern volatile unsigned char uartRxOverflow;	// bytes reçus perdus (buffer plein ou overrun matériel)
+extern volatile unsigned char uartTxOverflow;	// bytes refusés par uartWrite (buffer plein)
+#endif
 
 
+// Commande directe des moteurs (-100 à 100), sans rampe: arrête l'asservissement de motor.
 void setupMotorPWM(int vLeft, int vRight);
 
+/// To disable the motor control (ramps and speed loop), juste add the '-D nomotor=definition' compilation rule to entire project.
+#ifndef nomotor
+// Le timer 1 génère le PWM (phase correcte 10 bits, 3.9kHz sur PD5/OC1A gauche et PD4/OC1B droite,
+// direction sur PD7 et PD6); son débordement (256us) cadence le contrôle toutes les MOTOR_PERIOD périodes.
+#ifndef MOTOR_PERIOD
+#define MOTOR_PERIOD	39		// 9.98ms
+#endif
+#define MOTOR_LEFT		0
+#define MOTOR_RIGHT		1
+
+// Consignes en boucle ouverte: rapport cyclique de -1023 à 1023 (1023 = 100%).
+// Avec les codeurs (motorPI): vitesse en pas de codeur par période de contrôle.
+// La consigne suit la cible en variant d'au plus accel par période (0 = sans limite).
+void motorInit(void);			// configure le PWM une fois et démarre le contrôle (active les interruptions)
+void motorSpeed(int left, int right);
+void motorAccel(unsigned int accel);
+// Gains du PI en 1/256 (kp = ki = 0: boucle ouverte). Le terme intégral est borné au PWM maximum.
+void motorPI(unsigned char motor, int kp, int ki);
+// A appeler par l'interruption (ou interruptions désactivées) qui lit le codeur, delta = +1/-1 par pas.
+void motorEncoder(unsigned char motor, signed char delta);
+int motorMeasured(unsigned char motor);	// pas de codeur pendant la dernière période de contrôle
+int motorTarget(unsigned char motor);	// cible donnée par motorSpeed
+int motorDuty(unsigned char motor);		// rapport cyclique appliqué (-1023 à 1023)
+#endif
+
+/// To disable the timer 0 time base (and the agenda), juste add the '-D notimer=definition' compilation rule to entire project.
+#ifndef notimer
+// Le timer 0 est partagé: son débordement (2.048ms) cadence l'agenda, sa comparaison sert d'alarme.
+void timerStart(void);
+void timerAlarm(unsigned int ticks, void (*fct)(void));	// appelle fct sous interruption dans ticks x 8us
+// timerStart et timerAlarm n'activent pas les interruptions; pendant fct, l'agenda ne lance pas de callbacks.
+void timerAlarmCancel(void);
+unsigned long timerTicks(void);		// ticks de 2.048ms depuis timerStart (lecture atomique)
+// Temps depuis timerStart, lus de façon atomique: micros a une résolution de 8us et déborde après ~71 minutes.
+unsigned long millis(void);
+unsigned long micros(void);
+// Attente non bloquante: deadline = timeoutStart(5000); ... if(timeoutExpired(deadline)) ...
+unsigned long timeoutStart(unsigned long us);
+unsigned char timeoutExpired(unsigned long deadline);
+#endif
+
+// Incrémenté à l'entrée de chaque interruption de la bibliothèque (taskDispatch s'en sert pour ne pas
+// s'endormir après un évènement). Une interruption du programme peut aussi appeler ISR_WAKE().
+extern volatile unsigned char isrWakeCount;
+#define ISR_WAKE()	isrWakeCount++;
+
+/// To enable the interrupt statistics, add the '-D ISR_STATS' compilation rule to entire project (needs the timer 0).
+#ifdef ISR_STATS
+// Chaque interruption mesure sa durée avec le timer 0 (pas de 8us, interruptions imbriquées comprises),
+// et pour les timers le retard entre l'évènement et l'entrée dans l'interruption.
+// Un dépassement est compté quand l'évènement suivant est déjà arrivé à la sortie de l'interruption.
+// Les vecteurs des modules optionnels (extint, param, twi) ont leur ligne même quand le module n'est pas lié
+// (13 bytes de RAM chacune).
+enum {ISR_STATS_T0_COMP, ISR_STATS_T0_OVF, ISR_STATS_T1_OVF, ISR_STATS_T2_COMP, ISR_STATS_T2_OVF,
+	ISR_STATS_ADC, ISR_STATS_UART_RX, ISR_STATS_UART_UDRE,
+	ISR_STATS_INT0, ISR_STATS_INT1, ISR_STATS_INT2, ISR_STATS_EE_RDY, ISR_STATS_TWI, ISR_STATS_COUNT};
+
+typedef struct
+{
+	unsigned long count;
+	unsigned long durationTotal;	// en pas de 8us
+	unsigned int durationMax;		// en pas de 8us
+	unsigned int latencyMax;		// en pas de 8us
+	unsigned char overruns;			// sature à 255
+} isrStat;
+
+void isrStatsReset(void);
+void isrStatsGet(unsigned char vector, isrStat *stat);
+unsigned char isrStatsIdle(void);	// pourcentage du temps laissé au programme principal depuis isrStatsReset
+void isrStatsDump(void);			// envoie un tableau (une ligne par interruption) sur l'UART
+
+// A placer au début et à la fin d'une interruption définie hors de robopoly.c (latency en pas de 8us).
+unsigned int isrStatsEnter(void);
+void isrStatsLeave(unsigned char vector, unsigned int entry, unsigned int latency, unsigned char overrun);
+#define ISR_STATS_BEGIN(latency)		unsigned int isrEntry = isrStatsEnter(); unsigned int isrLatency = (latency);
+#define ISR_STATS_END(vector, overrun)	cli(); isrStatsLeave((vector), isrEntry, isrLatency, (overrun));
+#else
+#define ISR_STATS_BEGIN(latency)
+#define ISR_STATS_END(vector, overrun)
+#endif
+
 /// To disable all agenda structure and functions, juste add the '-D noagenda=definition' compilation rule to entire project.
 #ifndef	noagenda
+// Nombre maximum de callbacks simultanés (max 127), redéfinissable avec '-D AGENDA_SLOTS=16'
+#ifndef AGENDA_SLOTS
+#define AGENDA_SLOTS	8
+#endif
+// Par défaut les callbacks échus sont exécutés à la fin de l'interruption du timer, interruptions actives.
+// Avec '-D AGENDA_DEFERRED' ils ne sont exécutés que lorsque la boucle principale appelle agendaDispatch().
+void agendaDispatch(void);
+// duration en ticks de 2.048ms (max 32767, ~67s), executionNumber = 0 pour un callback sans fin
 char addNewCallback(void (* newcallbackaddr)(void), unsigned int duration, unsigned char executionNumber);
 void stopCallback(char callbackNumber);
 #endif
@@ -180,39 +412,76 @@ void stopCallback(char callbackNumber);
 
 /// To disable all servo structure and functions, juste add the '-D noservo=definition' compilation rule to entire project.
 #ifndef noservo
-//Definition des emplacements des servos. 
-//Pour modifier un emplacement (ligne), changer _portXX ainsi que _ddrXX ci dessous. 
-
-#define		SERVO_0  		_PORTC3
-#define 	SERVO_0_DIR		_DDRC3
-
-#define		SERVO_1  		_PORTC4
-#define 	SERVO_1_DIR		_DDRC4
-
-#define		SERVO_2  		_PORTC5
-#define 	SERVO_2_DIR		_DDRC5
-
-#define		SERVO_3  		_PORTC6
-#define 	SERVO_3_DIR		_DDRC6
-
-#define		SERVO_4  		_PORTC7
-#define 	SERVO_4_DIR		_DDRC7
-
-#define		SERVO_5  		_PORTB0
-#define 	SERVO_5_DIR		_DDRB0
-
-#define		SERVO_6  		_PORTB1
-#define 	SERVO_6_DIR		_DDRB1
-
-#define		SERVO_7  		_PORTB2
-#define 	SERVO_7_DIR		_DDRB2
-	
-#define		SERVO_8  		_PORTB3
-#define 	SERVO_8_DIR		_DDRB3
-
-#define		SERVO_9  		_PORTB4
-#define 	SERVO_9_DIR		_DDRB4	
+// Nombre de servos (chacun sur une ligne quelconque des ports A à D), redéfinissable avec '-D SERVO_COUNT=12'
+#ifndef SERVO_COUNT
+#define SERVO_COUNT		10
+#endif
+// Période de rafraîchissement de tous les servos, en microsecondes (résolution 16us, plus de 4096us)
+#ifndef SERVO_FRAME_US
+#define SERVO_FRAME_US	20000
 #endif
 
-void set_servo(unsigned char num_servo, char angle_servo);
+//Definition des emplacements par défaut des servos 0 à 9.
+//Pour modifier un emplacement (ligne), changer SERVO_n_PORT et SERVO_n_BIT ci dessous ou appeler servoAttach.
+
+#define		SERVO_0_PORT	C
+#define		SERVO_0_BIT		3
+
+#define		SERVO_1_PORT	C
+#define		SERVO_1_BIT		4
+
+#define		SERVO_2_PORT	C
+#define		SERVO_2_BIT		5
+
+#define		SERVO_3_PORT	C
+#define		SERVO_3_BIT		6
+
+#define		SERVO_4_PORT	C
+#define		SERVO_4_BIT		7
+
+#define		SERVO_5_PORT	B
+#define		SERVO_5_BIT		0
+
+#define		SERVO_6_PORT	B
+#define		SERVO_6_BIT		1
+
+#define		SERVO_7_PORT	B
+#define		SERVO_7_BIT		2		// INT2: à déplacer si extint.c utilise EXTINT_INT2 (extint.h)
+
+#define		SERVO_8_PORT	B
+#define		SERVO_8_BIT		3
+
+#define		SERVO_9_PORT	B
+#define		SERVO_9_BIT		4		// SS du SPI: doit rester en sortie avec la caméra en SPI (lcam_config.h)
+
+// Anciens noms, gardés pour les programmes existants: SERVO_n est le bit de PORTx de la ligne du servo n
+// (comme _PORTC3) et SERVO_n_DIR celui de DDRx. Ils suivent SERVO_n_PORT et SERVO_n_BIT, pas servoAttach.
+#define		SERVO_REG_BIT(reg, n)	SERVO_REG_BIT2(reg, n)
+#define		SERVO_REG_BIT2(reg, n)	(*(volatile bit_field *)(reg)).bit##n
+
+#define		SERVO_0			SERVO_REG_BIT(GPIO_PORT(SERVO_0_PORT), SERVO_0_BIT)
+#define		SERVO_0_DIR		SERVO_REG_BIT(GPIO_DDR(SERVO_0_PORT), SERVO_0_BIT)
+#define		SERVO_1			SERVO_REG_BIT(GPIO_PORT(SERVO_1_PORT), SERVO_1_BIT)
+#define		SERVO_1_DIR		SERVO_REG_BIT(GPIO_DDR(SERVO_1_PORT), SERVO_1_BIT)
+#define		SERVO_2			SERVO_REG_BIT(GPIO_PORT(SERVO_2_PORT), SERVO_2_BIT)
+#define		SERVO_2_DIR		SERVO_REG_BIT(GPIO_DDR(SERVO_2_PORT), SERVO_2_BIT)
+#define		SERVO_3			SERVO_REG_BIT(GPIO_PORT(SERVO_3_PORT), SERVO_3_BIT)
+#define		SERVO_3_DIR		SERVO_REG_BIT(GPIO_DDR(SERVO_3_PORT), SERVO_3_BIT)
+#define		SERVO_4			SERVO_REG_BIT(GPIO_PORT(SERVO_4_PORT), SERVO_4_BIT)
+#define		SERVO_4_DIR		SERVO_REG_BIT(GPIO_DDR(SERVO_4_PORT), SERVO_4_BIT)
+#define		SERVO_5			SERVO_REG_BIT(GPIO_PORT(SERVO_5_PORT), SERVO_5_BIT)
+#define		SERVO_5_DIR		SERVO_REG_BIT(GPIO_DDR(SERVO_5_PORT), SERVO_5_BIT)
+#define		SERVO_6			SERVO_REG_BIT(GPIO_PORT(SERVO_6_PORT), SERVO_6_BIT)
+#define		SERVO_6_DIR		SERVO_REG_BIT(GPIO_DDR(SERVO_6_PORT), SERVO_6_BIT)
+#define		SERVO_7			SERVO_REG_BIT(GPIO_PORT(SERVO_7_PORT), SERVO_7_BIT)
+#define		SERVO_7_DIR		SERVO_REG_BIT(GPIO_DDR(SERVO_7_PORT), SERVO_7_BIT)
+#define		SERVO_8			SERVO_REG_BIT(GPIO_PORT(SERVO_8_PORT), SERVO_8_BIT)
+#define		SERVO_8_DIR		SERVO_REG_BIT(GPIO_DDR(SERVO_8_PORT), SERVO_8_BIT)
+#define		SERVO_9			SERVO_REG_BIT(GPIO_PORT(SERVO_9_PORT), SERVO_9_BIT)
+#define		SERVO_9_DIR		SERVO_REG_BIT(GPIO_DDR(SERVO_9_PORT), SERVO_9_BIT)
+
+void set_servo(unsigned char num_servo, char angle_servo);	// angle de 0 à 100
+void servoAttach(unsigned char num_servo, unsigned char port, unsigned char bit);
+void servoDisable(unsigned char num_servo);
+#endif
 #endif
@@ -0,0 +1,112 @@
+/***************************************************************************************
+ *
+ * Tâches coopératives sans pile (style protothreads)
+ * Fichier: task.c
+ *
+ * Les tâches ne tournent que dans la boucle principale (taskDispatch); la table n'est
+ * donc jamais modifiée sous interruption.
+ *
+ ***************************************************************************************/
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include "robopoly.h"
+#include "task.h"
+
+static taskState tasks[TASK_SLOTS];
+
+char taskStart(taskFunction fct)
+{
+	unsigned char i;
+
+	for(i=0; i<TASK_SLOTS; i++)
+	{
+		if(!tasks[i].fct)
+		{
+			tasks[i].fct = fct;
+			tasks[i].line = 0;
+			tasks[i].asleep = 0;
+			timerStart();
+			return i;
+		}
+	}
+	return -1;
+}
+
+void taskStop(char task)
+{
+	if((unsigned char)task < TASK_SLOTS)
+	{
+		tasks[(unsigned char)task].fct = 0;
+	}
+}
+
+void taskSleep(taskState *t, unsigned long ms)
+{
+	t->wake = timeoutStart(ms * 1000UL);
+	t->asleep = 1;
+}
+
+void taskDispatch(void)
+{
+	unsigned char i, progress = 0, wake;
+	unsigned int line;
+	taskState *t;
+	char result;
+
+#ifndef noagenda
+	agendaDispatch();
+#endif
+
+	wake = isrWakeCount;
+	for(i=0; i<TASK_SLOTS; i++)
+	{
+		t = &tasks[i];
+		if(!t->fct || (t->asleep && !timeoutExpired(t->wake)))
+		{
+			continue;
+		}
+		t->asleep = 0;
+
+		line = t->line;
+		result = t->fct(t);
+		if(result == TASK_DONE)
+		{
+			t->fct = 0;
+		}
+		if(result != TASK_WAITING || t->line != line)
+		{
+			progress = 1;
+		}
+	}
+
+	// Rien n'a avancé: les conditions attendues ne peuvent changer que sous interruption.
+	// Une interruption servie pendant le passage (après un TASK_WAIT_UNTIL déjà évalué) a changé
+	// isrWakeCount: on repasse sans dormir. Sinon la comparaison faite sous cli tient jusqu'à sleep_cpu,
+	// car sei prend effet après l'instruction suivante: une interruption arrivée entre-temps le réveille.
+	if(!progress && (SREG & (1<<SREG_I)))
+	{
+		set_sleep_mode(SLEEP_MODE_IDLE);
+		cli();
+		if(isrWakeCount == wake)
+		{
+			sleep_enable();
+			sei();
+			sleep_cpu();
+			sleep_disable();
+		}
+		else
+		{
+			sei();
+		}
+	}
+}
+
+void taskRun(void)
+{
+	while(1)
+	{
+		taskDispatch();
+	}
+}
@@ -0,0 +1,119 @@
+#ifndef __task_h
+#define __task_h
+/***************************************************************************************
+ *
+ * Tâches coopératives sans pile (style protothreads)
+ * Fichier: task.h
+ *
+ ***************************************************************************************/
+
+/** \defgroup task_h Tâches
+
+	\brief	Plusieurs comportements qui attendent chacun de leur côté, sans pile par tâche
+
+	Une tâche est une fonction qui reprend là où elle s'était arrêtée: TASK_BEGIN/TASK_END encadrent
+	son corps, et TASK_YIELD, TASK_WAIT_UNTIL et TASK_SLEEP_MS rendent la main au dispatcher.
+	Les variables locales ne sont pas conservées entre deux appels: utiliser des variables static.
+	Les macros ne peuvent pas être utilisées dans un switch du corps de la tâche, ni deux fois sur la même ligne.
+
+	taskDispatch() exécute les callbacks différés de l'agenda puis chaque tâche prête une fois,
+	dans l'ordre de la table. Si aucune n'a avancé et qu'aucune interruption n'est arrivée pendant
+	le passage, le processeur dort jusqu'à la prochaine interruption (au plus 2.048ms avec le timer 0).
+	Une interruption du programme qui rend vraie la condition d'un TASK_WAIT_UNTIL doit appeler
+	ISR_WAKE(), sinon la tâche peut attendre le prochain débordement du timer 0.
+
+	\code
+	static char blink(taskState *t)
+	{
+		TASK_BEGIN(t);
+		while(1)
+		{
+			digitalWrite(C, 2, 1);
+			TASK_SLEEP_MS(t, 200);
+			digitalWrite(C, 2, 0);
+			TASK_SLEEP_MS(t, 200);
+		}
+		TASK_END(t);
+	}
+
+	static unsigned char position;		// position de la ligne, lue par les autres tâches
+
+	static char camera(taskState *t)
+	{
+		static unsigned char buffers[2*LCAM_PIXELS];
+
+		TASK_BEGIN(t);
+		lcam_async_start(buffers, 400, 20);
+		while(1)
+		{
+			TASK_WAIT_UNTIL(t, lcam_frame_ready());
+			position = lcam_getpic(lcam_acquire_frame());
+		}
+		TASK_END(t);
+	}
+
+	int main(void)
+	{
+		taskStart(blink);
+		taskStart(camera);
+		taskRun();
+	}
+	\endcode
+
+*/
+/*@{*/
+
+#ifdef notimer
+#error "les tâches utilisent le timer 0"
+#endif
+
+#ifndef TASK_SLOTS
+#define TASK_SLOTS	4		// Tâches simultanées (9 bytes de RAM chacune)
+#endif
+
+/** \brief Valeurs retournées par une tâche au dispatcher */
+enum {TASK_WAITING, TASK_YIELDED, TASK_DONE};
+
+typedef struct taskState taskState;
+typedef char (*taskFunction)(taskState *t);
+
+struct taskState
+{
+	taskFunction fct;			// 0: place libre
+	unsigned int line;			// point de reprise (__LINE__), 0 au début
+	unsigned long wake;			// échéance de TASK_SLEEP_MS (micros)
+	unsigned char asleep;
+};
+
+#define TASK_BEGIN(t)		switch((t)->line) { case 0:
+#define TASK_END(t)			} (t)->line = 0; return TASK_DONE
+
+/** \brief Rend la main, la tâche est rappelée au prochain passage */
+#define TASK_YIELD(t)		do{ (t)->line = __LINE__; return TASK_YIELDED; case __LINE__:; }while(0)
+
+/** \brief Rend la main tant que cond est fausse (cond est réévaluée à chaque passage) */
+#define TASK_WAIT_UNTIL(t, cond)	do{ (t)->line = __LINE__; case __LINE__: if(!(cond)) return TASK_WAITING; }while(0)
+
+/** \brief Rend la main pendant ms millisecondes (unsigned long, au plus 2147483 soit ~35 minutes) */
+#define TASK_SLEEP_MS(t, ms)	do{ taskSleep((t), (ms)); (t)->line = __LINE__; return TASK_WAITING; case __LINE__:; }while(0)
+
+/** \brief Ajoute une tâche à la table
+
+	\return Numéro de la tâche, -1 si la table est pleine
+
+*/
+char taskStart(taskFunction fct);
+
+/** \brief Retire une tâche (elle peut se retirer elle-même, mais doit alors retourner tout de suite) */
+void taskStop(char task);
+
+/** \brief Un passage sur toutes les tâches prêtes, puis sommeil si aucune n'a avancé */
+void taskDispatch(void);
+
+/** \brief Boucle principale: appelle taskDispatch() indéfiniment */
+void taskRun(void) __attribute__((noreturn));
+
+void taskSleep(taskState *t, unsigned long ms);	// utilisée par TASK_SLEEP_MS
+
+/*@}*/
+#endif
@@ -0,0 +1,402 @@
+/***************************************************************************************
+ *
+ * Télémétrie binaire sur l'UART
+ * Fichier: telemetry.c
+ *
+ * La file est partagée entre le programme principal, les interruptions qui envoient des
+ * enregistrements et telemetryPoll (agenda, interruption d'envoi de l'UART): elle n'est modifiée
+ * qu'interruptions désactivées.
+ * Une place réservée est remplie interruptions actives puis publiée en écrivant sa priorité.
+ *
+ ***************************************************************************************/
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/crc16.h>
+#include "robopoly.h"
+#include "telemetry.h"
+
+#define TELEMETRY_FREE		0xFF
+#define TELEMETRY_RESERVED	0xFE
+#define TELEMETRY_NONE		0xFF
+
+#define TELEMETRY_HEADER	4		// type, numéro, temps
+#define TELEMETRY_TRAILER	2		// CRC
+
+typedef struct
+{
+	unsigned char priority;		// TELEMETRY_FREE, TELEMETRY_RESERVED ou priorité
+	unsigned char length;
+	unsigned char header[TELEMETRY_HEADER];
+	unsigned char crc[TELEMETRY_TRAILER];
+	const unsigned char *data;	// copy ou données de l'appelant
+	unsigned char copy[TELEMETRY_INLINE];
+} telemetrySlot;
+
+// Encodage COBS de l'enregistrement en cours: un byte de code (longueur du bloc + 1),
+// puis les bytes non nuls du bloc; le byte nul qui termine le bloc n'est pas envoyé.
+enum {TELEMETRY_CODE, TELEMETRY_DATA, TELEMETRY_END};
+
+static telemetrySlot telemetrySlots[TELEMETRY_SLOTS];
+static unsigned char telemetryDecimate[TELEMETRY_DECIMATED];
+static unsigned char telemetryDecimateCount[TELEMETRY_DECIMATED];
+static unsigned char telemetrySeq = 0;
+
+static volatile unsigned char telemetryCurrent = TELEMETRY_NONE;
+static unsigned char telemetryPhase;
+static unsigned char telemetryPos;		// position dans en-tête + données + CRC
+static unsigned char telemetryBlock;	// bytes du bloc restant à envoyer
+static unsigned char telemetrySkipZero;	// le bloc se termine par un byte nul
+static unsigned char telemetryPolling = 0;
+
+volatile unsigned char telemetryDropped = 0;
+
+void telemetryInit(unsigned long baud)
+{
+	unsigned char i;
+
+	for(i=0; i<TELEMETRY_SLOTS; i++)
+	{
+		telemetrySlots[i].priority = TELEMETRY_FREE;
+	}
+	for(i=0; i<TELEMETRY_DECIMATED; i++)
+	{
+		telemetryDecimate[i] = 1;
+	}
+
+	uartInit();
+	if(baud)
+	{
+		uartSetBaud(baud);
+	}
+	uartSetRefill(telemetryPoll);
+#ifndef notimer
+	timerStart();
+#endif
+#ifndef noagenda
+	addNewCallback(telemetryPoll, 1, 0);
+#endif
+}
+
+void telemetryDecimation(unsigned char type, unsigned char n)
+{
+	unsigned char sreg = SREG;
+
+	if(type >= TELEMETRY_DECIMATED)
+	{
+		return;
+	}
+	cli();
+	telemetryDecimate[type] = n;
+	telemetryDecimateCount[type] = 0;
+	SREG = sreg;
+}
+
+// Place pour un nouvel enregistrement de priorité donnée, interruptions désactivées
+static unsigned char telemetryReserve(unsigned char priority)
+{
+	unsigned char i, victim = TELEMETRY_NONE;
+
+	for(i=0; i<TELEMETRY_SLOTS; i++)
+	{
+		if(telemetrySlots[i].priority == TELEMETRY_FREE)
+		{
+			return i;
+		}
+		// le plus ancien de priorité plus basse, hors enregistrement en cours d'envoi
+		if(i != telemetryCurrent && telemetrySlots[i].priority < priority
+			&& (victim == TELEMETRY_NONE || telemetrySlots[i].priority < telemetrySlots[victim].priority
+				|| (telemetrySlots[i].priority == telemetrySlots[victim].priority
+					&& (unsigned char)(telemetrySeq - telemetrySlots[i].header[1])
+						> (unsigned char)(telemetrySeq - telemetrySlots[victim].header[1]))))
+		{
+			victim = i;
+		}
+	}
+	telemetryDropped++;
+	return victim;
+}
+
+unsigned char telemetrySend(unsigned char type, const void *data, unsigned char length, unsigned char priority)
+{
+	unsigned char sreg = SREG;
+	unsigned char i, slot;
+	unsigned int crc = 0xFFFF, ticks = 0;
+	telemetrySlot *s;
+
+	if(length > TELEMETRY_MAX_LENGTH)
+	{
+		return 0;
+	}
+#ifndef notimer
+	ticks = timerTicks();
+#endif
+
+	cli();
+	if(type < TELEMETRY_DECIMATED)
+	{
+		if(!telemetryDecimate[type] || ++telemetryDecimateCount[type] < telemetryDecimate[type])
+		{
+			SREG = sreg;
+			return 0;
+		}
+		telemetryDecimateCount[type] = 0;
+	}
+	slot = telemetryReserve(priority);
+	if(slot == TELEMETRY_NONE)
+	{
+		SREG = sreg;
+		return 0;
+	}
+	s = &telemetrySlots[slot];
+	s->priority = TELEMETRY_RESERVED;
+	s->header[1] = telemetrySeq++;
+	SREG = sreg;
+
+	s->length = length;
+	s->header[0] = type;
+	s->header[2] = ticks & 0xFF;
+	s->header[3] = ticks >> 8;
+	if(length <= TELEMETRY_INLINE)
+	{
+		for(i=0; i<length; i++)
+		{
+			s->copy[i] = ((const unsigned char *)data)[i];
+		}
+		s->data = s->copy;
+	}
+	else
+	{
+		s->data = data;
+	}
+
+	for(i=0; i<TELEMETRY_HEADER; i++)
+	{
+		crc = _crc_ccitt_update(crc, s->header[i]);
+	}
+	for(i=0; i<length; i++)
+	{
+		crc = _crc_ccitt_update(crc, s->data[i]);
+	}
+	s->crc[0] = crc & 0xFF;
+	s->crc[1] = crc >> 8;
+
+	s->priority = priority;		// publié
+	return 1;
+}
+
+unsigned char telemetryBusy(const void *data)
+{
+	unsigned char sreg = SREG;
+	unsigned char i, busy = 0;
+
+	cli();
+	for(i=0; i<TELEMETRY_SLOTS; i++)
+	{
+		if(telemetrySlots[i].priority != TELEMETRY_FREE && telemetrySlots[i].data == data)
+		{
+			busy = 1;
+		}
+	}
+	SREG = sreg;
+	return busy;
+}
+
+// Enregistrement suivant: la plus haute priorité, puis le plus ancien
+static unsigned char telemetryNext(void)
+{
+	unsigned char sreg = SREG;
+	unsigned char i, best = TELEMETRY_NONE;
+	telemetrySlot *s;
+
+	cli();
+	for(i=0; i<TELEMETRY_SLOTS; i++)
+	{
+		s = &telemetrySlots[i];
+		if(s->priority >= TELEMETRY_RESERVED)
+		{
+			continue;
+		}
+		if(best == TELEMETRY_NONE || s->priority > telemetrySlots[best].priority
+			|| (s->priority == telemetrySlots[best].priority
+				&& (unsigned char)(telemetrySeq - s->header[1]) > (unsigned char)(telemetrySeq - telemetrySlots[best].header[1])))
+		{
+			best = i;
+		}
+	}
+	telemetryCurrent = best;
+	SREG = sreg;
+	return best;
+}
+
+static unsigned char telemetryByte(const telemetrySlot *s, unsigned char pos)
+{
+	if(pos < TELEMETRY_HEADER)
+	{
+		return s->header[pos];
+	}
+	pos -= TELEMETRY_HEADER;
+	if(pos < s->length)
+	{
+		return s->data[pos];
+	}
+	return s->crc[pos - s->length];
+}
+
+void telemetryPoll(void)
+{
+	unsigned char sreg = SREG;
+	unsigned char room, total, k, c;
+	unsigned char phase, pos, block, skip;
+	telemetrySlot *s;
+
+	cli();
+	if(telemetryPolling)
+	{
+		SREG = sreg;
+		return;		// appelée sous interruption pendant un autre appel
+	}
+	telemetryPolling = 1;
+	SREG = sreg;
+
+	room = uartTxFree();
+	while(room)
+	{
+		if(telemetryCurrent == TELEMETRY_NONE)
+		{
+			if(telemetryNext() == TELEMETRY_NONE)
+			{
+				break;
+			}
+			telemetryPhase = TELEMETRY_CODE;
+			telemetryPos = 0;
+		}
+		s = &telemetrySlots[telemetryCurrent];
+		total = s->length + TELEMETRY_HEADER + TELEMETRY_TRAILER;
+
+		// l'état n'avance qu'une fois le byte accepté par l'UART (autre producteur sur le buffer d'envoi)
+		phase = telemetryPhase;
+		pos = telemetryPos;
+		block = telemetryBlock;
+		skip = telemetrySkipZero;
+
+		if(phase == TELEMETRY_CODE)
+		{
+			// jusqu'au prochain byte nul, à la fin ou à 254 bytes
+			k = 0;
+			while(k < 254 && pos + k < total && telemetryByte(s, pos + k))
+			{
+				k++;
+			}
+			c = k + 1;
+			block = k;
+			skip = (k < 254 && pos + k < total);
+			phase = k ? TELEMETRY_DATA : TELEMETRY_CODE;
+		}
+		else if(phase == TELEMETRY_DATA)
+		{
+			c = telemetryByte(s, pos++);
+			if(--block == 0)
+			{
+				phase = TELEMETRY_CODE;
+			}
+		}
+		else
+		{
+			c = 0;		// fin de trame
+		}
+
+		if(phase == TELEMETRY_CODE && !block && telemetryPhase != TELEMETRY_END)
+		{
+			if(skip)
+			{
+				pos++;
+				skip = 0;
+			}
+			else if(pos == total)
+			{
+				phase = TELEMETRY_END;
+			}
+		}
+
+		if(!uartWrite(&c, 1))
+		{
+			break;		// repris au même byte au prochain appel
+		}
+		room--;
+
+		if(telemetryPhase == TELEMETRY_END)
+		{
+			cli();
+			s->priority = TELEMETRY_FREE;
+			telemetryCurrent = TELEMETRY_NONE;
+			SREG = sreg;
+		}
+		telemetryPhase = phase;
+		telemetryPos = pos;
+		telemetryBlock = block;
+		telemetrySkipZero = skip;
+	}
+
+	telemetryPolling = 0;
+}
+
+
+void telemetryText(const char *text, unsigned char priority)
+{
+	unsigned char length = 0;
+
+	while(text[length] && length < TELEMETRY_MAX_LENGTH)
+	{
+		length++;
+	}
+	telemetrySend(TELEMETRY_TEXT, text, length, priority);
+}
+
+void telemetryLcamFrame(const unsigned char *image, unsigned char priority)
+{
+	telemetrySend(TELEMETRY_LCAM_FRAME, image, LCAM_PIXELS, priority);
+}
+
+void telemetryLcamLine(const lcam_stats_t *stats, unsigned char priority)
+{
+	unsigned char line[6];
+
+	line[0] = stats->position & 0xFF;
+	line[1] = stats->position >> 8;
+	line[2] = stats->confidence;
+	line[3] = stats->min;
+	line[4] = stats->max;
+	line[5] = stats->peaks;
+	telemetrySend(TELEMETRY_LCAM_LINE, line, sizeof(line), priority);
+}
+
+#ifndef noadc
+void telemetryAdc(unsigned char priority)
+{
+	analog_t values[8];
+	unsigned char i;
+
+	for(i=0; i<8; i++)
+	{
+		values[i] = analogGet(i);
+	}
+	telemetrySend(TELEMETRY_ADC, values, sizeof(values), priority);
+}
+#endif
+
+#ifndef nomotor
+void telemetryMotor(unsigned char priority)
+{
+	int values[6];
+	unsigned char i;
+
+	for(i=0; i<2; i++)
+	{
+		values[3*i] = motorTarget(i);
+		values[3*i + 1] = motorDuty(i);
+		values[3*i + 2] = motorMeasured(i);
+	}
+	telemetrySend(TELEMETRY_MOTOR, values, sizeof(values), priority);
+}
+#endif
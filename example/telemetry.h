@@ -0,0 +1,179 @@
+#ifndef __telemetry_h
+#define __telemetry_h
+/***************************************************************************************
+ *
+ * Télémétrie binaire sur l'UART
+ * Fichier: telemetry.h
+ *
+ * Chaque enregistrement est envoyé en une trame COBS terminée par un byte nul:
+ *     type, numéro (8 bits), temps (16 bits, ticks de 2.048ms), données, CRC-16
+ * Les valeurs sur plusieurs bytes sont envoyées LSB d'abord. Le CRC est celui de
+ * _crc_ccitt_update (polynôme 0x8408, valeur initiale 0xFFFF) sur tout ce qui précède.
+ * Le décodeur de référence est telemetry.py.
+ *
+ ***************************************************************************************/
+
+/** \defgroup telemetry_h Télémétrie
+
+	\brief	Envoi non bloquant d'enregistrements binaires (images de la caméra, mesures, consignes)
+
+	Les enregistrements attendent dans une file de TELEMETRY_SLOTS places et sont encodés au fil de l'eau
+	dans le buffer d'envoi de l'UART par telemetryPoll(). Elle est appelée par l'interruption d'envoi
+	chaque fois que le buffer se vide à moitié, ce qui tient 500000 bauds avec UART_TX_BUFFER_SIZE = 32,
+	et par l'agenda toutes les 2.048ms pour démarrer l'envoi d'un enregistrement quand l'UART est au repos
+	(avec -D noagenda, la boucle principale doit l'appeler). Aucune fonction n'attend la fin d'un envoi.
+
+	Les données de plus de TELEMETRY_INLINE bytes (images de la caméra...) ne sont pas copiées: elles sont
+	lues dans la mémoire de l'appelant pendant l'envoi, qui doit rester valide et inchangée jusque-là
+	(telemetryBusy()). Pas de variable locale d'une fonction qui retourne avant la fin de l'envoi.
+
+	Quand la file est pleine, un nouvel enregistrement remplace le plus ancien de priorité plus basse
+	en attente, sinon il est perdu. Les pertes sont comptées et visibles à la réception (numéros manquants).
+
+*/
+/*@{*/
+
+#include <string.h>
+#include "lcam.h"
+
+#ifdef nouart
+#error "la télémétrie utilise l'UART"
+#endif
+
+#ifndef TELEMETRY_SLOTS
+#define TELEMETRY_SLOTS		4		// Enregistrements en attente (26 bytes de RAM chacun)
+#endif
+#ifndef TELEMETRY_INLINE
+#define TELEMETRY_INLINE	16		// Les enregistrements jusqu'à cette taille sont copiés dans la file
+#endif
+#define TELEMETRY_MAX_LENGTH	249		// Taille maximale des données d'un enregistrement
+
+/** \brief Types d'enregistrements
+
+	Les types 0 à TELEMETRY_DECIMATED-1 peuvent être décimés avec telemetryDecimation().
+	Les programmes peuvent utiliser leurs propres types à partir de TELEMETRY_USER.
+
+*/
+enum
+{
+	TELEMETRY_TEXT,			// Texte sans byte nul final
+	TELEMETRY_LCAM_FRAME,	// LCAM_PIXELS pixels
+	TELEMETRY_LCAM_LINE,	// position (16 bits, 1/256 pixel), confidence, min, max, peaks
+	TELEMETRY_ADC,			// 8 mesures du scanner, 8 ou 16 bits selon ADC_BITS
+	TELEMETRY_MOTOR,		// cible, consigne appliquée (PWM) et vitesse mesurée, gauche puis droite (16 bits signés)
+	TELEMETRY_LOG,			// telemetryLog: identifiant du format (16 bits) puis arguments bruts
+	TELEMETRY_USER
+};
+#define TELEMETRY_DECIMATED	8
+
+/** \brief Priorités: un enregistrement ne peut remplacer qu'un enregistrement de priorité plus basse */
+enum {TELEMETRY_LOW, TELEMETRY_NORMAL, TELEMETRY_HIGH};
+
+
+/** \brief Initialisation de l'UART, du timer et de l'envoi périodique
+
+	\param baud Vitesse de l'UART (0 garde BAUD). 500000 est exacte à 8MHz et disponible sous Linux.
+
+*/
+void telemetryInit(unsigned long baud);
+
+/** \brief Ajoute un enregistrement à la file
+
+	Les données de plus de TELEMETRY_INLINE bytes ne sont pas copiées: elles doivent rester inchangées
+	tant que telemetryBusy() retourne 1, sinon l'enregistrement sera rejeté par le CRC à la réception.
+	Peut être appelée sous interruption.
+
+	\param type Type de l'enregistrement
+	\param data Données
+	\param length Taille des données (au plus TELEMETRY_MAX_LENGTH)
+	\param priority TELEMETRY_LOW, TELEMETRY_NORMAL ou TELEMETRY_HIGH
+	\return 1 si l'enregistrement est en file, 0 s'il est décimé ou perdu
+
+*/
+unsigned char telemetrySend(unsigned char type, const void *data, unsigned char length, unsigned char priority);
+
+/** \brief N'envoie qu'un enregistrement sur n du type donné (1 = tous, 0 = aucun) */
+void telemetryDecimation(unsigned char type, unsigned char n);
+
+/** \brief Retourne 1 tant que des données non copiées sont en file ou en cours d'envoi */
+unsigned char telemetryBusy(const void *data);
+
+/** \brief Encode dans le buffer d'envoi de l'UART tout ce qui y tient, sans attendre */
+void telemetryPoll(void);
+
+/** \brief Nombre d'enregistrements perdus (file pleine) */
+extern volatile unsigned char telemetryDropped;
+
+void telemetryText(const char *text, unsigned char priority);
+void telemetryLcamFrame(const unsigned char *image, unsigned char priority);	// l'image n'est pas copiée
+void telemetryLcamLine(const lcam_stats_t *stats, unsigned char priority);
+#ifndef noadc
+void telemetryAdc(unsigned char priority);
+#endif
+#ifndef nomotor
+void telemetryMotor(unsigned char priority);
+#endif
+
+
+/** \brief Journal formaté sur le PC
+
+	telemetryLog(priority, fmt, ...) s'écrit comme un printf, mais le format reste dans le fichier .out:
+	il est placé dans la section .logfmt, qui n'est pas chargée dans la flash, et son adresse dans cette
+	section sert d'identifiant. Seuls l'identifiant et les valeurs brutes des arguments sont envoyés,
+	dans un enregistrement TELEMETRY_LOG, et telemetry.py -e example.out (ou le dictionnaire écrit par
+	make logdict) refait la ligne de texte. Le format est vérifié à la compilation comme pour printf.
+
+	Conversions: %d %i %u %x %X %o %c (int), avec l pour les long, %e %f %g (float), %p; pas de %s.
+	Au plus TELEMETRY_INLINE - 2 bytes d'arguments (2 par int, 4 par long ou float), 7 arguments.
+	fmt doit être une seule chaîne littérale.
+
+	\code
+	telemetryLog(TELEMETRY_NORMAL, "vitesse %d cible %d erreur %ld", speed, target, error);
+	\endcode
+
+*/
+#define telemetryLog(priority, fmt, ...)	do{																\
+	static const char telemetryLogFormat[] __attribute__((section(TELEMETRY_LOG_SECTION), used)) = fmt;	\
+	unsigned char telemetryLogData[2 TELEMETRY_LOG_EACH(TELEMETRY_LOG_SIZE, ##__VA_ARGS__)];			\
+	unsigned char *telemetryLogPtr = telemetryLogData + 2;												\
+	typedef char telemetryLogTooLong[(sizeof(telemetryLogData) <= TELEMETRY_INLINE) ? 1 : -1]			\
+		__attribute__((unused));																		\
+	if(0)																								\
+	{																									\
+		telemetryLogCheck(fmt, ##__VA_ARGS__);															\
+	}																									\
+	telemetryLogData[0] = (unsigned int)telemetryLogFormat & 0xFF;										\
+	telemetryLogData[1] = (unsigned int)telemetryLogFormat >> 8;										\
+	TELEMETRY_LOG_EACH(TELEMETRY_LOG_PUT, ##__VA_ARGS__)												\
+	(void)telemetryLogPtr;																				\
+	telemetrySend(TELEMETRY_LOG, telemetryLogData, sizeof(telemetryLogData), (priority));				\
+}while(0)
+
+// Section sans drapeaux (non chargée): le reste de la ligne écrite par gcc est mis en commentaire
+#define TELEMETRY_LOG_SECTION	".logfmt,\"\",@progbits ;"
+
+static inline void telemetryLogCheck(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static inline void telemetryLogCheck(const char *fmt, ...)
+{
+}
+
+// Les arguments sont envoyés après la promotion des arguments de printf (char -> int)
+#define TELEMETRY_LOG_SIZE(x)	+ sizeof((x) + 0)
+#define TELEMETRY_LOG_PUT(x)	{ __typeof__((x) + 0) v = (x); memcpy(telemetryLogPtr, &v, sizeof(v)); telemetryLogPtr += sizeof(v); }
+
+#define TELEMETRY_LOG_EACH(m, ...)	TELEMETRY_LOG_CAT(TELEMETRY_LOG_EACH, TELEMETRY_LOG_COUNT(__VA_ARGS__))(m, ##__VA_ARGS__)
+#define TELEMETRY_LOG_COUNT(...)	TELEMETRY_LOG_NTH(0, ##__VA_ARGS__, 7, 6, 5, 4, 3, 2, 1, 0)
+#define TELEMETRY_LOG_NTH(z, a, b, c, d, e, f, g, n, ...)	n
+#define TELEMETRY_LOG_CAT(a, b)		TELEMETRY_LOG_CAT2(a, b)
+#define TELEMETRY_LOG_CAT2(a, b)	a##b
+#define TELEMETRY_LOG_EACH0(m)
+#define TELEMETRY_LOG_EACH1(m, x)		m(x)
+#define TELEMETRY_LOG_EACH2(m, x, ...)	m(x) TELEMETRY_LOG_EACH1(m, __VA_ARGS__)
+#define TELEMETRY_LOG_EACH3(m, x, ...)	m(x) TELEMETRY_LOG_EACH2(m, __VA_ARGS__)
+#define TELEMETRY_LOG_EACH4(m, x, ...)	m(x) TELEMETRY_LOG_EACH3(m, __VA_ARGS__)
+#define TELEMETRY_LOG_EACH5(m, x, ...)	m(x) TELEMETRY_LOG_EACH4(m, __VA_ARGS__)
+#define TELEMETRY_LOG_EACH6(m, x, ...)	m(x) TELEMETRY_LOG_EACH5(m, __VA_ARGS__)
+#define TELEMETRY_LOG_EACH7(m, x, ...)	m(x) TELEMETRY_LOG_EACH6(m, __VA_ARGS__)
+
+/*@}*/
+#endif
@@ -0,0 +1,337 @@
+#!/usr/bin/env python
+"""Decoder for the binary telemetry stream sent by telemetry.c.
+
+Each record is a COBS frame terminated by a zero byte. Once decoded, a frame
+holds:
+
+    type (1 byte), sequence number (1 byte), time (2 bytes, 2.048 ms ticks),
+    data, CRC-16 (2 bytes)
+
+Multi-byte values are little-endian. The CRC is the one of avr-libc's
+_crc_ccitt_update (reflected polynomial 0x8408, initial value 0xFFFF) over
+everything before it.
+
+One line is printed per record, tab separated: time in seconds, type name,
+then the decoded fields. Frames with a bad CRC are reported as 'crc' lines.
+Records are numbered when queued but sent by priority, so the numbers can
+arrive out of order; the ones still missing at the end are counted as lost.
+
+    ./telemetry.py -p /dev/ttyUSB0 -b 500000
+    ./telemetry.py -p /dev/ttyUSB0 -w run.tlm      # also record the raw stream
+    ./telemetry.py -f run.tlm                      # replay a recording
+    ./telemetry.py -f run.tlm -l run.lcam          # camera frames for lcamtool
+    ./telemetry.py -f run.tlm -e example.out       # log lines of telemetryLog
+
+With -l, the camera frames are also written in the fixed-record format read by
+lcamtool.c: a 16-byte header ('LCAMLOG1', pixel count and record size as 16-bit
+values, 4 reserved bytes), then one 112-byte record per frame holding the 102
+pixels, 2 reserved bytes, the time in ticks and the frame number (32 bits each).
+
+telemetryLog records only hold a format identifier and the raw arguments. The
+format strings are read with -e from the .logfmt section of the program (the
+.out file that was flashed), or from a dictionary written by 'make logdict'
+(--dict), one 'identifier<TAB>format' line per string.
+"""
+
+import sys
+import os
+import re
+import struct
+import termios
+import select
+from optparse import OptionParser
+
+# Record types, see telemetry.h
+TEXT       = 0
+LCAM_FRAME = 1
+LCAM_LINE  = 2
+ADC        = 3
+MOTOR      = 4
+LOG        = 5
+
+TICK = 0.002048
+
+LCAM_PIXELS = 102
+LCAM_RECORD = 112
+
+_usage = """%prog [Options]"""
+
+def crc_ccitt_update(crc, data):
+  # Same computation as _crc_ccitt_update in <util/crc16.h>
+  data ^= crc & 0xFF
+  data = (data ^ (data << 4)) & 0xFF
+  return ((data << 8) | (crc >> 8)) ^ (data >> 4) ^ (data << 3)
+
+def crc16(s):
+  crc = 0xFFFF
+  for c in s:
+    crc = crc_ccitt_update(crc, ord(c)) & 0xFFFF
+  return crc
+
+def cobs_decode(frame):
+  """Decode one COBS frame (without its zero terminator), None if malformed"""
+  out = []
+  i = 0
+  while i < len(frame):
+    code = ord(frame[i])
+    if code == 0 or i + code > len(frame):
+      return None
+    out.append(frame[i+1:i+code])
+    i += code
+    if code < 0xFF and i < len(frame):
+      out.append('\0')
+  return ''.join(out)
+
+def elf_section(data, name):
+  """Address and contents of a section of an ELF file, None if absent"""
+  if data[:4] != '\x7fELF':
+    return None
+  is64 = ord(data[4]) == 2
+  end = (ord(data[5]) == 2) and '>' or '<'
+  if is64:
+    shoff, = struct.unpack(end + 'Q', data[0x28:0x30])
+    shentsize, shnum, shstrndx = struct.unpack(end + 'HHH', data[0x3A:0x40])
+  else:
+    shoff, = struct.unpack(end + 'I', data[0x20:0x24])
+    shentsize, shnum, shstrndx = struct.unpack(end + 'HHH', data[0x2E:0x34])
+
+  def header(i):
+    h = data[shoff + i*shentsize:shoff + (i+1)*shentsize]
+    if is64:
+      nameoff, stype, flags, addr, offset, size = struct.unpack(end + 'IIQQQQ', h[:40])
+    else:
+      nameoff, stype, flags, addr, offset, size = struct.unpack(end + 'IIIIII', h[:24])
+    return nameoff, addr, offset, size
+
+  nameoff, addr, offset, size = header(shstrndx)
+  names = data[offset:offset+size]
+  for i in range(shnum):
+    nameoff, addr, offset, size = header(i)
+    if names[nameoff:names.index('\0', nameoff)] == name:
+      return addr, data[offset:offset+size]
+  return None
+
+def load_logdict(name):
+  """Format strings of telemetryLog by identifier, from the program or from a dictionary"""
+  data = open(name, 'rb').read()
+  logdict = {}
+  if data[:4] == '\x7fELF':
+    section = elf_section(data, '.logfmt')
+    if section is None:
+      return logdict
+    addr, contents = section
+    start = 0
+    for fmt in contents.split('\0'):
+      if fmt:
+        logdict[(addr + start) & 0xFFFF] = fmt
+      start += len(fmt) + 1
+  else:
+    for line in data.splitlines():
+      if line and not line.startswith('#'):
+        ident, fmt = line.split('\t', 1)
+        logdict[int(ident, 0)] = fmt.decode('string_escape')
+  return logdict
+
+# printf conversions, with the argument sizes of avr-gcc (int 16 bits, float 32 bits)
+_conversion = re.compile(r'%([-+ #0]*[0-9]*(?:\.[0-9]*)?)(hh|h|ll|l)?([diouxXcfeEgGp%])')
+
+def format_log(fmt, args):
+  """printf on the host with the raw arguments sent by the target, None if they do not match"""
+  values = []
+  pos = [0]
+
+  def convert(m):
+    flags, length, conv = m.groups()
+    if conv == '%':
+      return '%%'
+    size = (length in ('l', 'll') or conv in 'feEgG') and 4 or 2
+    raw = args[pos[0]:pos[0]+size]
+    pos[0] += size
+    if len(raw) < size:
+      raise ValueError
+    if conv in 'feEgG':
+      values.append(struct.unpack('<f', raw)[0])
+    elif conv in 'di':
+      values.append(struct.unpack((size == 4) and '<i' or '<h', raw)[0])
+    else:
+      values.append(struct.unpack((size == 4) and '<I' or '<H', raw)[0])
+    if conv == 'p':
+      return '0x%04x'
+    if conv == 'u':
+      conv = 'd'
+    return '%' + flags + conv
+
+  try:
+    pyfmt = _conversion.sub(convert, fmt.replace('%%', '\0'))
+    if pos[0] != len(args):
+      return None
+    return (pyfmt.replace('\0', '%%') % tuple(values)).replace('\n', ' ')
+  except (ValueError, TypeError, OverflowError):
+    return None
+
+def format_record(rtype, data, logdict=None):
+  if rtype == TEXT:
+    return 'text', data
+  if rtype == LCAM_FRAME:
+    return 'lcam_frame', ' '.join([str(ord(c)) for c in data])
+  if rtype == LCAM_LINE and len(data) == 6:
+    position, confidence, low, high, peaks = struct.unpack('<HBBBB', data)
+    return 'lcam_line', '%.3f\t%d\t%d\t%d\t%d' % (position/256.0, confidence, low, high, peaks)
+  if rtype == ADC and len(data) in (8, 16):
+    fmt = (len(data) == 8) and '<8B' or '<8H'
+    return 'adc', ' '.join([str(v) for v in struct.unpack(fmt, data)])
+  if rtype == MOTOR and len(data) == 12:
+    return 'motor', '\t'.join([str(v) for v in struct.unpack('<6h', data)])
+  if rtype == LOG and len(data) >= 2:
+    ident, = struct.unpack('<H', data[:2])
+    text = None
+    if logdict and ident in logdict:
+      text = format_log(logdict[ident], data[2:])
+    if text is None:
+      return 'log', 'id 0x%04x\t%s' % (ident, data[2:].encode('hex'))
+    return 'log', text
+  return 'type%d' % rtype, data.encode('hex')
+
+class LcamLog:
+  def __init__(self, name):
+    self.f = open(name, 'wb')
+    self.f.write(struct.pack('<8sHH4x', 'LCAMLOG1', LCAM_PIXELS, LCAM_RECORD))
+    self.frames = 0
+
+  def write(self, ticks, pixels):
+    self.f.write(pixels + struct.pack('<2xII', ticks & 0xFFFFFFFF, self.frames))
+    self.frames += 1
+
+class Decoder:
+  def __init__(self, out, lcamlog=None, logdict=None):
+    self.out = out
+    self.lcamlog = lcamlog
+    self.logdict = logdict
+    self.pending = ''
+    self.seq = None       # highest sequence number seen
+    self.missing = set()
+    self.ticks = None     # 32-bit time rebuilt from the 16-bit tick counter
+    self.records = 0
+    self.errors = 0
+    self.lost = 0
+
+  def feed(self, s):
+    frames = (self.pending + s).split('\0')
+    self.pending = frames.pop()
+    for frame in frames:
+      if frame:
+        self.frame(frame)
+
+  def frame(self, frame):
+    record = cobs_decode(frame)
+    if record is None or len(record) < 6 or crc16(record[:-2]) != struct.unpack('<H', record[-2:])[0]:
+      self.errors += 1
+      self.out.write('crc\t%d bytes\n' % len(frame))
+      return
+
+    rtype, seq, ticks = struct.unpack('<BBH', record[:4])
+    if self.seq is None:
+      self.seq = seq
+    elif 0 < (seq - self.seq) & 0xFF < 128:
+      # ahead: the numbers skipped may still come with a lower priority
+      for n in range(self.seq + 1, self.seq + ((seq - self.seq) & 0xFF)):
+        self.missing.add(n & 0xFF)
+      self.missing.discard(seq)
+      # numbers more than half a turn old will not come any more
+      for n in list(self.missing):
+        if (seq - n) & 0xFF >= 128:
+          self.missing.remove(n)
+          self.lost += 1
+      self.seq = seq
+    else:
+      self.missing.discard(seq)
+
+    if self.ticks is None:
+      self.ticks = ticks
+    else:
+      self.ticks += (ticks - self.ticks) & 0xFFFF
+    self.records += 1
+
+    if self.lcamlog and rtype == LCAM_FRAME and len(record) == LCAM_PIXELS + 6:
+      self.lcamlog.write(self.ticks, record[4:-2])
+
+    name, fields = format_record(rtype, record[4:-2], self.logdict)
+    self.out.write('%.3f\t%s\t%s\n' % (self.ticks * TICK, name, fields))
+
+def open_port(port, baud):
+  dev = os.open(port, os.O_RDWR | os.O_NOCTTY | os.O_NDELAY)
+  try:
+    baudmask = getattr(termios, 'B%d' % baud)
+  except AttributeError:
+    print 'Unable to set baud rate to %d' % baud
+    sys.exit(1)
+  attr = termios.tcgetattr(dev)
+  attr[0] = termios.IGNBRK
+  attr[1] = 0
+  attr[2] = termios.CS8|termios.CREAD|termios.CLOCAL|baudmask
+  attr[3] = 0
+  attr[4] = baudmask
+  attr[5] = baudmask
+  attr[6][termios.VMIN] = 1
+  attr[6][termios.VTIME] = 0
+  termios.tcsetattr(dev, termios.TCSAFLUSH, attr)
+  return dev
+
+if __name__ == "__main__":
+  parser = OptionParser(usage=_usage)
+  parser.add_option("-p", "--port", dest="Port", default=None, metavar="PORT", \
+                    help="Serial port to read (e.g. /dev/ttyUSB0)")
+  parser.add_option("-b", "--baud", dest="BaudRate", type="int", default=500000, metavar="BAUD", \
+                    help="Baud rate, as given to telemetryInit (default: 500000)")
+  parser.add_option("-f", "--file", dest="File", default=None, metavar="FILE", \
+                    help="Decode a raw stream recorded with -w instead of a serial port")
+  parser.add_option("-w", "--write", dest="Record", default=None, metavar="FILE", \
+                    help="Also record the raw stream to FILE")
+  parser.add_option("-l", "--lcam", dest="Lcam", default=None, metavar="FILE", \
+                    help="Also write the camera frames to FILE, for lcamtool")
+  parser.add_option("-e", "--elf", dest="Elf", default=None, metavar="FILE", \
+                    help="Program (.out) or dictionary holding the telemetryLog formats")
+  parser.add_option("--dict", dest="Dict", action="store_true", default=False, \
+                    help="Print the telemetryLog dictionary of the program given with -e and exit")
+  (options, args) = parser.parse_args()
+
+  logdict = options.Elf and load_logdict(options.Elf)
+  if options.Dict:
+    if not options.Elf:
+      parser.error('--dict needs the program (-e)')
+    for ident in sorted(logdict):
+      print '0x%04x\t%s' % (ident, logdict[ident].encode('string_escape'))
+    sys.exit(0)
+
+  if (options.Port is None) == (options.File is None):
+    parser.error('give either a serial port (-p) or a recording (-f)')
+
+  lcamlog = options.Lcam and LcamLog(options.Lcam)
+  decoder = Decoder(sys.stdout, lcamlog, logdict)
+  record = options.Record and open(options.Record, 'wb')
+
+  try:
+    if options.File:
+      f = open(options.File, 'rb')
+      while 1:
+        s = f.read(65536)
+        if not s:
+          break
+        decoder.feed(s)
+    else:
+      dev = open_port(options.Port, options.BaudRate)
+      while 1:
+        select.select([dev], [], [])
+        s = os.read(dev, 4096)
+        if record:
+          record.write(s)
+        decoder.feed(s)
+        sys.stdout.flush()
+  except KeyboardInterrupt:
+    pass
+
+  decoder.lost += len(decoder.missing)
+  sys.stderr.write('%d records, %d lost, %d bad frames\n' % (decoder.records, decoder.lost, decoder.errors))
+  if lcamlog:
+    lcamlog.f.close()
+    sys.stderr.write('%d camera frames written to %s\n' % (lcamlog.frames, options.Lcam))
@@ -0,0 +1,291 @@
+/***************************************************************************************
+ *
+ * Maître TWI (I2C) par interruption, avec file de transactions
+ * Fichier: twi.c
+ *
+ * La file contient des pointeurs vers les transactions des appelants; celle du bout
+ * (twiTail) est en cours tant que twiActive vaut 1. Chaque interruption TWI fait un pas
+ * de la transaction en cours, puis le STOP de la fin est suivi du START de la suivante.
+ *
+ ***************************************************************************************/
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/twi.h>
+#include <util/delay_basic.h>
+#include "robopoly.h"
+#include "twi.h"
+
+#define TWI_SCL		PC0
+#define TWI_SDA		PC1
+#define TWI_DELAY()	_delay_loop_1(F_CPU / 600000)		// 5us: demi-période de SCL à 100kHz
+
+#define TWI_GO		((1<<TWINT)|(1<<TWEN)|(1<<TWIE))
+#define TWI_STOP	(TWI_GO|(1<<TWSTO))
+#define TWI_RESTART	(TWI_GO|(1<<TWSTO)|(1<<TWSTA))		// STOP puis START de la transaction suivante
+
+static twiTransfer *twiQueue[TWI_QUEUE];
+static volatile unsigned char twiHead = 0;
+static volatile unsigned char twiTail = 0;
+static volatile unsigned char twiActive = 0;
+static unsigned char twiPos;			// byte en cours dans tx ou rx
+static unsigned int twiBitCycles = 80;	// cycles par bit de SCL (100kHz tant que twiInit n'a pas tourné)
+
+// Débloque le bus à la main, TWI désactivé: SCL pulsé tant que SDA est à 0, puis STOP.
+// Les pins sont en drain ouvert: DDR à 1 pour tirer la ligne à 0, à 0 pour la relâcher.
+static void twiBusRelease(void)
+{
+	unsigned char port = PORTC & ((1<<TWI_SCL)|(1<<TWI_SDA));
+	unsigned char i;
+
+	TWCR = 0;
+	PORTC &= ~((1<<TWI_SCL)|(1<<TWI_SDA));
+	DDRC &= ~((1<<TWI_SCL)|(1<<TWI_SDA));
+	TWI_DELAY();
+	for(i = 0; i < 9 && !(PINC & (1<<TWI_SDA)); i++)
+	{
+		DDRC |= (1<<TWI_SCL);
+		TWI_DELAY();
+		DDRC &= ~(1<<TWI_SCL);
+		TWI_DELAY();
+	}
+
+	DDRC |= (1<<TWI_SCL);
+	TWI_DELAY();
+	DDRC |= (1<<TWI_SDA);
+	TWI_DELAY();
+	DDRC &= ~(1<<TWI_SCL);
+	TWI_DELAY();
+	DDRC &= ~(1<<TWI_SDA);		// SDA monte pendant que SCL est haut: STOP
+	TWI_DELAY();
+
+	PORTC |= port;				// résistances de tirage internes comme avant
+}
+
+// Interruptions désactivées. Le STOP précédent doit être parti avant de demander un START:
+// attente bornée à ~3 bits de SCL (au moins 6 cycles par tour), un esclave qui bloque le bus
+// est laissé à twiRecover()
+static void twiStart(void)
+{
+	unsigned int n;
+
+	for(n = twiBitCycles / 2; n && (TWCR & (1<<TWSTO)); n--)
+	{
+	}
+	TWCR = TWI_GO | (1<<TWSTA);
+}
+
+// Retire la transaction en cours et appelle sa fonction; retourne 1 s'il en reste une en file.
+// La fonction peut soumettre une transaction: twiActive vaut encore 1, elle est seulement mise en file.
+static unsigned char twiFinish(unsigned char status)
+{
+	twiTransfer *t = twiQueue[twiTail & (TWI_QUEUE - 1)];
+
+	twiTail++;
+	t->status = status;
+	if(t->done)
+	{
+		t->done(t);
+	}
+	if(twiTail != twiHead)
+	{
+		return 1;
+	}
+	twiActive = 0;
+	return 0;
+}
+
+// Un pas de la transaction en cours, TWINT à 1
+static void twiStep(void)
+{
+	twiTransfer *t = twiQueue[twiTail & (TWI_QUEUE - 1)];
+
+	switch(TW_STATUS)
+	{
+		case TW_START:
+			twiPos = 0;
+			TWDR = (t->address << 1) | (t->txLength ? TW_WRITE : TW_READ);
+			TWCR = TWI_GO;
+			break;
+
+		case TW_REP_START:
+			twiPos = 0;
+			TWDR = (t->address << 1) | TW_READ;
+			TWCR = TWI_GO;
+			break;
+
+		case TW_MT_SLA_ACK:
+		case TW_MT_DATA_ACK:
+			if(twiPos < t->txLength)
+			{
+				TWDR = t->tx[twiPos++];
+				TWCR = TWI_GO;
+			}
+			else if(t->rxLength)
+			{
+				TWCR = TWI_GO | (1<<TWSTA);		// START répété, puis lecture
+			}
+			else
+			{
+				TWCR = twiFinish(TWI_OK) ? TWI_RESTART : TWI_STOP;
+			}
+			break;
+
+		case TW_MR_DATA_ACK:
+			t->rx[twiPos++] = TWDR;
+			// pas de break
+		case TW_MR_SLA_ACK:
+			TWCR = (twiPos + 1 < t->rxLength) ? TWI_GO | (1<<TWEA) : TWI_GO;	// NACK après le dernier byte
+			break;
+
+		case TW_MR_DATA_NACK:
+			t->rx[twiPos] = TWDR;
+			TWCR = twiFinish(TWI_OK) ? TWI_RESTART : TWI_STOP;
+			break;
+
+		case TW_MT_SLA_NACK:
+		case TW_MT_DATA_NACK:
+		case TW_MR_SLA_NACK:
+			TWCR = twiFinish(TWI_NACK) ? TWI_RESTART : TWI_STOP;
+			break;
+
+		case TW_MT_ARB_LOST:		// = TW_MR_ARB_LOST: bus relâché, START quand il sera libre
+			TWCR = twiFinish(TWI_ERROR) ? TWI_GO | (1<<TWSTA) : TWI_GO;
+			break;
+
+		default:					// TW_BUS_ERROR: START ou STOP à une place interdite
+			TWCR = TWI_STOP;		// libère les lignes sans envoyer de STOP
+			if(twiFinish(TWI_ERROR))
+			{
+				twiStart();
+			}
+			break;
+	}
+}
+
+ISR(TWI_vect)
+{
+	ISR_STATS_BEGIN(0)
+	ISR_WAKE()
+	twiStep();
+	ISR_STATS_END(ISR_STATS_TWI, 0)
+}
+
+void twiInit(unsigned long hz)
+{
+	unsigned char sreg = SREG;
+	unsigned long div = hz ? F_CPU / hz : 0xFFFFFFFF;		// 0: vitesse minimale
+	unsigned char prescaler = 0;
+
+	div = (div > 36) ? (div - 16) / 2 : 10;
+	while(div > 255 && prescaler < 3)
+	{
+		div = (div + 3) >> 2;		// arrondi vers une fréquence plus basse
+		prescaler++;
+	}
+
+	cli();
+	twiBusRelease();
+	TWBR = (div > 255) ? 255 : (div < 10) ? 10 : div;
+	TWSR = prescaler;
+	twiBitCycles = 16 + ((unsigned int)TWBR << (2*prescaler + 1));
+	TWCR = (1<<TWEN);
+	twiHead = twiTail;
+	twiActive = 0;
+	SREG = sreg;
+}
+
+unsigned char twiSubmit(twiTransfer *transfer)
+{
+	unsigned char sreg = SREG;
+
+	if(!transfer->txLength && !transfer->rxLength)
+	{
+		return 0;
+	}
+
+	cli();
+	if((unsigned char)(twiHead - twiTail) >= TWI_QUEUE)
+	{
+		SREG = sreg;
+		return 0;
+	}
+	transfer->status = TWI_PENDING;
+	twiQueue[twiHead & (TWI_QUEUE - 1)] = transfer;
+	twiHead++;
+	if(!twiActive)
+	{
+		twiActive = 1;
+		twiStart();
+	}
+	SREG = sreg;
+	return 1;
+}
+
+unsigned char twiWriteRead(twiTransfer *transfer, unsigned char address, const void *tx, unsigned char txLength,
+	void *rx, unsigned char rxLength, twiCallback done)
+{
+	transfer->address = address;
+	transfer->tx = (const unsigned char *)tx;
+	transfer->txLength = txLength;
+	transfer->rx = (unsigned char *)rx;
+	transfer->rxLength = rxLength;
+	transfer->done = done;
+	return twiSubmit(transfer);
+}
+
+// Pas de 8us: le délai ne dépend pas du timer 0 et compte aussi interruptions désactivées
+#define TWI_WAIT_STEP_US	8
+
+unsigned char twiWait(twiTransfer *transfer)
+{
+	unsigned char tail = twiTail;
+	unsigned long waited = 0, limit;
+
+	// deux fois la durée de la transaction (9 bits par byte, START et STOP compris) plus 1ms
+	limit = (transfer->txLength + transfer->rxLength + 3) * 18UL * twiBitCycles / (F_CPU / 1000000) + 1000;
+
+	while(transfer->status == TWI_PENDING)
+	{
+		// interruptions désactivées: on avance à la main
+		if(!(SREG & (1<<SREG_I)) && (TWCR & (1<<TWINT)))
+		{
+			twiStep();
+		}
+
+		// le délai recommence à chaque transaction terminée devant celle-ci
+		if(twiTail != tail)
+		{
+			tail = twiTail;
+			waited = 0;
+		}
+		else if(waited >= limit)
+		{
+			twiRecover();		// la transaction en cours finit en TWI_ERROR
+			tail = twiTail;
+			waited = 0;
+		}
+		_delay_loop_2(F_CPU / 4 / (1000000 / TWI_WAIT_STEP_US));
+		waited += TWI_WAIT_STEP_US;
+	}
+	return transfer->status;
+}
+
+unsigned char twiBusy(void)
+{
+	return twiActive;
+}
+
+void twiRecover(void)
+{
+	unsigned char sreg = SREG;
+
+	cli();
+	twiBusRelease();
+	TWCR = (1<<TWEN);
+	if(twiActive && twiFinish(TWI_ERROR))
+	{
+		twiStart();
+	}
+	SREG = sreg;
+}
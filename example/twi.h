@@ -0,0 +1,121 @@
+#ifndef __twi_h
+#define __twi_h
+/***************************************************************************************
+ *
+ * Maître TWI (I2C) par interruption, avec file de transactions
+ * Fichier: twi.h
+ *
+ ***************************************************************************************/
+
+/** \defgroup twi_h TWI (I2C)
+
+	\brief	Lectures et écritures I2C (gyroscope, télémètres, boussole...) faites par l'interruption TWI
+
+	Une transaction (twiTransfer) écrit txLength bytes puis, après un START répété, lit rxLength bytes
+	dans le même esclave: écriture seule, lecture seule ou écriture puis lecture (numéro de registre
+	suivi de sa valeur). twiSubmit() la met en file et rend la main tout de suite; l'interruption TWI
+	enchaîne les transactions, et la boucle principale calcule pendant ce temps.
+
+	La transaction et ses buffers appartiennent au module jusqu'à la fin: status vaut TWI_PENDING
+	jusque-là, puis TWI_OK, TWI_NACK (esclave absent ou qui refuse un byte) ou TWI_ERROR (erreur de
+	bus, arbitrage perdu, twiRecover()). La fonction done est alors appelée depuis l'interruption:
+	elle doit être courte, et peut relancer la transaction ou en soumettre une autre.
+
+	\code
+	static unsigned char gyroRegister = 0x28 | 0x80;	// OUT_X_L, auto-incrément
+	static int gyro[3];
+	static twiTransfer gyroRead;
+
+	int main(void)
+	{
+		twiInit(100000);
+		sei();
+		while(1)
+		{
+			if(gyroRead.status != TWI_PENDING)
+			{
+				// gyro[] contient la mesure précédente (si status == TWI_OK)
+				twiWriteRead(&gyroRead, 0x6B, &gyroRegister, 1, gyro, sizeof(gyro), 0);
+			}
+			//...
+		}
+	}
+	\endcode
+
+	Un esclave réinitialisé au milieu d'une lecture peut garder SDA à 0 et bloquer le bus sans
+	erreur détectable: une transaction qui reste TWI_PENDING trop longtemps (quelques ms) se débloque
+	avec twiRecover(), que twiWait() appelle elle-même après un délai.
+	SCL (PC0) et SDA (PC1) ont besoin de résistances de tirage (4.7k typique).
+	Le vecteur TWI_vect est défini par ce module.
+
+*/
+/*@{*/
+
+#ifndef TWI_QUEUE
+#define TWI_QUEUE	4		// Transactions en attente, puissance de 2 (2 bytes de RAM chacune)
+#endif
+
+#if TWI_QUEUE & (TWI_QUEUE - 1)
+#error "TWI_QUEUE doit être une puissance de 2"
+#endif
+
+/** \brief Etat d'une transaction */
+enum {TWI_OK, TWI_PENDING, TWI_NACK, TWI_ERROR};
+
+struct twiTransfer;
+typedef void (*twiCallback)(struct twiTransfer *transfer);
+
+/** \brief Une transaction, remplie par twiWriteRead() ou à la main avant twiSubmit() */
+typedef struct twiTransfer
+{
+	unsigned char address;			// Adresse de l'esclave sur 7 bits
+	const unsigned char *tx;		// Bytes à écrire
+	unsigned char txLength;
+	unsigned char *rx;				// Bytes lus
+	unsigned char rxLength;
+	twiCallback done;				// Appelée depuis l'interruption à la fin (0: aucune)
+	volatile unsigned char status;	// TWI_PENDING jusqu'à la fin
+} twiTransfer;
+
+/** \brief Active le TWI en maître, après avoir débloqué le bus si nécessaire
+
+	\param hz Fréquence de SCL, limitée à F_CPU/36 (222kHz à 8MHz: TWBR >= 10 en maître);
+		0 ou moins de ~250Hz: vitesse minimale
+
+*/
+void twiInit(unsigned long hz);
+
+/** \brief Met une transaction en file (txLength et rxLength ne peuvent pas être tous les deux nuls)
+
+	\return 1 si la transaction est en file, 0 si la file est pleine ou la transaction vide
+
+*/
+unsigned char twiSubmit(twiTransfer *transfer);
+
+/** \brief Remplit et soumet une transaction: écriture seule (rxLength = 0), lecture seule (txLength = 0)
+	ou écriture puis lecture
+
+	\return comme twiSubmit()
+
+*/
+unsigned char twiWriteRead(twiTransfer *transfer, unsigned char address, const void *tx, unsigned char txLength,
+	void *rx, unsigned char rxLength, twiCallback done);
+
+/** \brief Attend la fin d'une transaction soumise et retourne son état (interruptions activées ou non)
+
+	Si le bus n'avance plus pendant deux fois la durée de la transaction plus 1ms, twiRecover()
+	est appelée: la transaction bloquée finit en TWI_ERROR.
+
+*/
+unsigned char twiWait(twiTransfer *transfer);
+
+/** \brief Retourne 1 tant qu'une transaction est en file ou en cours */
+unsigned char twiBusy(void);
+
+/** \brief Débloque le bus: la transaction en cours finit en TWI_ERROR, SCL est pulsé jusqu'à ce que
+	l'esclave relâche SDA, puis un STOP est envoyé et la file reprend
+*/
+void twiRecover(void);
+
+/*@}*/
+#endif